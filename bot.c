@@ -0,0 +1,330 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bot.h"
+#include "trace.h"
+
+// Four masks at a time; gcc turns the operations below into SSE2 on x86
+typedef uint32_t mask_vec __attribute__((vector_size(16)));
+#define LANES 4
+#if DICT_MASK_PAD % LANES != 0
+#error "Compiled dictionaries must pad their masks to whole vectors"
+#endif
+// Vectors count_letters can add before its 5-bit counters overflow
+#define COUNT_VECTORS 31
+
+// Letters to fall back on when no word fits, most common in English first
+#define LETTER_ORDER "etaoinshrdlcumwfgypbvkjxqz"
+
+
+/* Return the bitmask of the letters in the first len characters of word. */
+static uint32_t letter_mask(const char *word, int len) {
+    uint32_t mask = 0;
+    for (int i = 0; i < len; i++) {
+        mask |= 1u << (word[i] - 'a');
+    }
+    return mask;
+}
+
+/* Count the words of each length, for the first pass of build_word_index. */
+static void count_word(char *word, void *arg) {
+    struct word_index *index = arg;
+    int len = strlen(word);
+    if (len < MAX_WORD && strspn(word, "abcdefghijklmnopqrstuvwxyz") == len) {
+        index->buckets[len].count++;
+    }
+}
+
+/* Append word to its bucket, for the second pass of build_word_index. */
+static void add_word(char *word, void *arg) {
+    struct word_index *index = arg;
+    int len = strlen(word);
+    if (len < MAX_WORD && strspn(word, "abcdefghijklmnopqrstuvwxyz") == len) {
+        struct word_bucket *b = &index->buckets[len];
+        /* build_word_index allocated these, so they may be written. */
+        uint32_t *masks = (uint32_t *) b->masks;
+        memcpy((char *) b->letters + b->count * len, word, len);
+        masks[b->count] = letter_mask(word, len);
+        for (uint32_t m = masks[b->count]; m != 0; m &= m - 1) {
+            b->letter_counts[__builtin_ctz(m)]++;
+        }
+        b->count++;
+    }
+}
+
+/* Release index and whatever its buckets hold. */
+static void free_word_index(struct word_index *index) {
+    for (int len = 0; len < MAX_WORD && !index->mapped; len++) {
+        free((void *) index->buckets[len].masks);
+        free((void *) index->buckets[len].letters);
+    }
+    free(index);
+}
+
+/* Index every word in dict by length for the bots to search. A compiled
+ * dictionary already holds the index, so its buckets only point into the
+ * mapping; a text dictionary is read twice to build them. Return NULL if
+ * there is not enough memory.
+ */
+struct word_index *build_word_index(struct dictionary *dict) {
+    struct word_index *index = calloc(1, sizeof(struct word_index));
+    if (index == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+
+    if (dict->buckets != NULL) {
+        index->mapped = 1;
+        for (int len = 0; len < MAX_WORD; len++) {
+            const struct dict_bucket *d = &dict->buckets[len];
+            struct word_bucket *b = &index->buckets[len];
+            b->count = d->count;
+            b->masks = (const uint32_t *) (dict->index + d->masks);
+            b->letters = (const char *) (dict->index + d->letters);
+            for (int i = 0; i < NUM_LETTERS; i++) {
+                b->letter_counts[i] = d->letter_counts[i];
+            }
+        }
+        return index;
+    }
+
+    dict_foreach(dict, count_word, index);
+    for (int len = 1; len < MAX_WORD; len++) {
+        struct word_bucket *b = &index->buckets[len];
+        /* Round up to whole vectors so that scans never read past the end. */
+        int padded = (b->count + LANES - 1) / LANES * LANES;
+        b->masks = calloc(padded + 1, sizeof(uint32_t));
+        b->letters = malloc(b->count * len + 1);
+        if (b->masks == NULL || b->letters == NULL) {
+            perror("malloc");
+            free_word_index(index);
+            return NULL;
+        }
+        b->count = 0;
+    }
+    dict_foreach(dict, add_word, index);
+    return index;
+}
+
+
+/* Return 1 if word, whose letter mask already passed the vector test, also
+ * has every revealed letter of pattern in place and no guessed letter in
+ * the positions that are still hidden.
+ */
+static int fits_pattern(const char *word, const char *pattern, int len,
+                        uint32_t guessed) {
+    for (int i = 0; i < len; i++) {
+        if (pattern[i] == '-') {
+            if (guessed & (1u << (word[i] - 'a'))) {
+                return 0;
+            }
+        } else if (word[i] != pattern[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Keep the candidates consistent with the game so far. The first filter of
+ * a game reads the whole bucket for the word's length; later ones only
+ * rescan the survivors of the previous turn, compacting them in place.
+ */
+static void narrow(struct candidates *c, struct word_bucket *b,
+                   struct game_state *game) {
+    uint32_t guessed = 0;
+    for (int i = 0; i < NUM_LETTERS; i++) {
+        if (game->letters_guessed[i]) {
+            guessed |= 1u << i;
+        }
+    }
+    uint32_t present = 0;
+    for (int i = 0; i < c->length; i++) {
+        if (game->guess[i] != '-') {
+            present |= 1u << (game->guess[i] - 'a');
+        }
+    }
+    uint32_t missed = guessed & ~present;
+    /* Until a letter is revealed, a word fits the pattern exactly when it
+     * has none of the guessed letters, which the vector test checks.
+     */
+    int check_pattern = (present != 0);
+
+    const uint32_t *masks = c->narrowed ? c->masks : b->masks;
+    int total = c->narrowed ? c->count : b->count;
+    mask_vec missed_vec = {missed, missed, missed, missed};
+    mask_vec present_vec = {present, present, present, present};
+    int kept = 0;
+
+    for (int i = 0; i < total; i += LANES) {
+        mask_vec m;
+        memcpy(&m, masks + i, sizeof(m));
+        /* A lane is all ones if its word has no missed letter and every
+         * revealed one.
+         */
+        mask_vec fits = ((m & missed_vec) == 0) & ((m & present_vec) == present_vec);
+        if ((fits[0] | fits[1] | fits[2] | fits[3]) == 0) {
+            continue;
+        }
+        int lanes = total - i < LANES ? total - i : LANES;
+        if (!check_pattern) {
+            /* Store every lane and keep the ones that fit, without a branch
+             * the processor would mispredict for most words.
+             */
+            for (int lane = 0; lane < lanes; lane++) {
+                c->masks[kept] = m[lane];
+                c->ids[kept] = c->narrowed ? c->ids[i + lane] : i + lane;
+                kept += (fits[lane] != 0);
+            }
+            continue;
+        }
+        for (int lane = 0; lane < lanes; lane++) {
+            if (fits[lane] == 0) {
+                continue;
+            }
+            int id = c->narrowed ? c->ids[i + lane] : i + lane;
+            if (fits_pattern(b->letters + id * c->length, game->guess, c->length, guessed)) {
+                c->masks[kept] = m[lane];
+                c->ids[kept] = id;
+                kept++;
+            }
+        }
+    }
+    c->count = kept;
+    c->narrowed = 1;
+}
+
+/* Add to counts the number of the n masks that contain each letter.
+ *
+ * Rather than visiting every letter of every word, the masks are added a
+ * vector at a time into five bit planes: bit l of ones, twos, fours,
+ * eights and sixteens holds a 5-bit counter for letter l in that lane, so
+ * one addition updates the counters of all 26 letters with a ripple of ANDs
+ * and XORs. The planes are folded into counts every COUNT_VECTORS vectors,
+ * before the counters can overflow.
+ */
+static void count_letters(const uint32_t *masks, int n, int *counts) {
+    int i = 0;
+    while (n - i >= LANES) {
+        mask_vec ones = {0, 0, 0, 0};
+        mask_vec twos = ones;
+        mask_vec fours = ones;
+        mask_vec eights = ones;
+        mask_vec sixteens = ones;
+        for (int v = 0; v < COUNT_VECTORS && n - i >= LANES; v++, i += LANES) {
+            mask_vec m;
+            memcpy(&m, masks + i, sizeof(m));
+            mask_vec carry = ones & m;
+            ones ^= m;
+            mask_vec carry2 = twos & carry;
+            twos ^= carry;
+            carry = fours & carry2;
+            fours ^= carry2;
+            carry2 = eights & carry;
+            eights ^= carry;
+            sixteens ^= carry2;
+        }
+        for (int l = 0; l < NUM_LETTERS; l++) {
+            mask_vec sum = ((ones >> l) & 1) + (((twos >> l) & 1) << 1) +
+                (((fours >> l) & 1) << 2) + (((eights >> l) & 1) << 3) +
+                (((sixteens >> l) & 1) << 4);
+            counts[l] += sum[0] + sum[1] + sum[2] + sum[3];
+        }
+    }
+    /* Count the masks that don't fill a vector one letter at a time. */
+    for (; i < n; i++) {
+        for (uint32_t m = masks[i]; m != 0; m &= m - 1) {
+            counts[__builtin_ctz(m)]++;
+        }
+    }
+}
+
+/* Return the most common letter in English that game has not seen yet. */
+static int common_letter(struct game_state *game) {
+    for (char *l = LETTER_ORDER; *l; l++) {
+        if (!game->letters_guessed[*l - 'a']) {
+            return *l;
+        }
+    }
+    return 'a';
+}
+
+/* Return the letter the bot guesses in game: the unguessed letter that
+ * appears in the most candidate words, which gives the best chance of a hit.
+ * Without memory for the candidates it falls back on common letters.
+ */
+int bot_choose_letter(struct game_state *game) {
+    struct candidates *c = game->candidates;
+    int len = strlen(game->guess);
+    struct word_bucket *b = &game->words->buckets[len];
+
+    if (c == NULL) {
+        if ((c = calloc(1, sizeof(struct candidates))) == NULL) {
+            perror("calloc");
+            return common_letter(game);
+        }
+        game->candidates = c;
+    }
+    /* Start over for each new word. */
+    if (c->round != game->round || c->length != len) {
+        if (c->capacity < b->count + LANES) {
+            int capacity = b->count + LANES;
+            uint32_t *masks = realloc(c->masks, capacity * sizeof(uint32_t));
+            if (masks != NULL) {
+                c->masks = masks;
+            }
+            int *ids = realloc(c->ids, capacity * sizeof(int));
+            if (ids != NULL) {
+                c->ids = ids;
+            }
+            if (masks == NULL || ids == NULL) {
+                perror("realloc");
+                return common_letter(game);
+            }
+            c->capacity = capacity;
+        }
+        c->round = game->round;
+        c->length = len;
+        c->narrowed = 0;
+    }
+
+    int counts[NUM_LETTERS] = {0};
+    int any_guessed = 0;
+    for (int i = 0; i < NUM_LETTERS; i++) {
+        any_guessed |= game->letters_guessed[i];
+    }
+    /* Before any guess every word of the right length is a candidate. */
+    if (!any_guessed) {
+        memcpy(counts, b->letter_counts, sizeof(counts));
+    } else {
+        narrow(c, b, game);
+        count_letters(c->masks, c->count, counts);
+    }
+    int best = -1;
+    for (int i = 0; i < NUM_LETTERS; i++) {
+        if (!game->letters_guessed[i] && counts[i] > 0 &&
+            (best == -1 || counts[i] > counts[best])) {
+            best = i;
+        }
+    }
+    if (best != -1) {
+        return 'a' + best;
+    }
+
+    /* The word isn't in the index; guess common letters instead. */
+    return common_letter(game);
+}
+
+/* If it is the bot's turn in game, make its guess and return 1.
+ * Otherwise return 0.
+ */
+int bot_turn(struct game_state *game, struct game_events *events) {
+    if (game->words == NULL || game->turn == -1 || game->fds[game->turn] != BOT_FD) {
+        return 0;
+    }
+    CYCLES_BEGIN(H_BOT);
+    char line[2] = {bot_choose_letter(game), '\0'};
+    CYCLES_END(H_BOT);
+    game_guess(game, &game->bot, line, events);
+    return 1;
+}
@@ -0,0 +1,51 @@
+#ifndef _BOT_H_
+#define _BOT_H_
+
+#include <stdint.h>
+
+#include "gameplay.h"
+
+/* Server-side players for rooms with a single human.
+ *
+ * The bot guesses the letter that appears in the most dictionary words
+ * still consistent with the game: words of the right length that agree
+ * with every revealed letter and contain none of the letters that missed.
+ * The words are indexed into buckets by length, each word stored with a
+ * bitmask of its letters so that most words can be ruled out by a vector
+ * test on the masks alone. A compiled dictionary carries the index in its
+ * mapping (see dictionary.h); for a text dictionary it is built in memory
+ * the first time a bot is seated. Each game keeps the set of candidates
+ * that survived the bot's last turn and narrows it further on the next one
+ * instead of rescanning the dictionary.
+ */
+
+// The words of one length, packed without terminators
+struct word_bucket {
+    int count;
+    const uint32_t *masks;    // Bit i is set if the word contains 'a' + i
+    const char *letters;      // count words of the bucket's length
+    int letter_counts[NUM_LETTERS]; // Number of words containing each letter
+};
+
+struct word_index {
+    int mapped;               // The buckets point into a compiled dictionary
+    struct word_bucket buckets[MAX_WORD];
+};
+
+// The words that may still be the answer in one game
+struct candidates {
+    unsigned int round;       // The game (see game_state) they belong to
+    int length;
+    int narrowed;             // 0 until the first filter of this game
+    int count;
+    int capacity;
+    uint32_t *masks;
+    int *ids;                 // Index of each candidate in its bucket
+};
+
+
+struct word_index *build_word_index(struct dictionary *dict);
+int bot_choose_letter(struct game_state *game);
+int bot_turn(struct game_state *game, struct game_events *events);
+
+#endif
@@ -0,0 +1,310 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "gameplay.h"
+#include "dictionary.h"
+
+
+/* Return the number of lines in the file
+ */
+int get_file_length(char *filename) {
+    char buf[MAX_MSG];
+    int count = 0;
+    FILE *fp;
+    if ((fp = fopen(filename, "r")) == NULL) {
+        perror("open");
+        exit(1);
+    }
+
+    while (fgets(buf, MAX_MSG, fp) != NULL) {
+        count++;
+    }
+
+    fclose(fp);
+    return count;
+}
+
+
+/* Return the offset of the word index in a compiled dictionary with header
+ * h: just after the block data, rounded up to DICT_ALIGN.
+ */
+size_t dict_index_offset(const struct dict_header *h) {
+    size_t end = sizeof(*h) + (size_t) h->num_blocks * sizeof(uint32_t) + h->data_size;
+    return (end + DICT_ALIGN - 1) / DICT_ALIGN * DICT_ALIGN;
+}
+
+/* Return 1 if every word of the compiled dictionary dict decodes inside its
+ * block, shares no more than the previous word has and fits in MAX_WORD,
+ * so that dict_word can never read past the end of the mapping.
+ */
+static int valid_blocks(struct dictionary *dict, uint32_t data_size) {
+    for (int b = 0; b < dict->num_blocks; b++) {
+        uint32_t pos = dict->blocks[b];
+        uint32_t end = (b + 1 < dict->num_blocks) ? dict->blocks[b + 1] : data_size;
+        int words = dict->size - b * DICT_BLOCK_SIZE;
+        int prev_len = 0;
+        if (words > DICT_BLOCK_SIZE) {
+            words = DICT_BLOCK_SIZE;
+        }
+        if (end > data_size || pos > end) {
+            return 0;
+        }
+        for (int i = 0; i < words; i++) {
+            if (end - pos < 2) {
+                return 0;
+            }
+            int prefix = dict->data[pos];
+            int len = dict->data[pos + 1];
+            if ((i == 0 && prefix != 0) || prefix > prev_len ||
+                prefix + len >= MAX_WORD || end - pos - 2 < len) {
+                return 0;
+            }
+            pos += 2 + len;
+            prev_len = prefix + len;
+        }
+    }
+    return 1;
+}
+
+/* Return 1 if every bucket of the word index of dict lies inside the index
+ * and holds only the letters a-z, which the bot uses to index masks.
+ */
+static int valid_index(struct dictionary *dict, const struct dict_header *h) {
+    if (h->num_lengths != MAX_WORD ||
+        h->index_size < h->num_lengths * sizeof(struct dict_bucket)) {
+        return 0;
+    }
+    for (int len = 0; len < MAX_WORD; len++) {
+        const struct dict_bucket *b = &dict->buckets[len];
+        uint64_t padded = ((uint64_t) b->count + DICT_MASK_PAD - 1) /
+            DICT_MASK_PAD * DICT_MASK_PAD;
+        if (b->count > h->num_words || (len == 0 && b->count != 0) ||
+            b->masks % sizeof(uint32_t) != 0 ||
+            b->masks + padded * sizeof(uint32_t) > h->index_size ||
+            b->letters + (uint64_t) b->count * len > h->index_size) {
+            return 0;
+        }
+        const unsigned char *letters = dict->index + b->letters;
+        for (uint64_t i = 0; i < (uint64_t) b->count * len; i++) {
+            if (letters[i] < 'a' || letters[i] > 'z') {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/* Map the compiled dictionary in fd and check that its header, block table,
+ * words and word index are consistent with the size of the file.
+ */
+static void map_compiled(struct dictionary *dict, int fd) {
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("fstat");
+        exit(1);
+    }
+    dict->map_len = st.st_size;
+    if (dict->map_len < sizeof(struct dict_header)) {
+        fprintf(stderr, "%s is not a valid compiled dictionary\n", dict->filename);
+        exit(1);
+    }
+    dict->map = mmap(NULL, dict->map_len, PROT_READ, MAP_SHARED, fd, 0);
+    if (dict->map == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+
+    const struct dict_header *h = (const struct dict_header *) dict->map;
+    if (h->version != DICT_VERSION) {
+        fprintf(stderr, "%s was compiled for version %u; rebuild it with mkdict\n",
+                dict->filename, h->version);
+        exit(1);
+    }
+    size_t table_len = (size_t) h->num_blocks * sizeof(uint32_t);
+    if (h->block_size != DICT_BLOCK_SIZE || h->num_words == 0 ||
+        h->num_blocks != (h->num_words + DICT_BLOCK_SIZE - 1) / DICT_BLOCK_SIZE ||
+        dict_index_offset(h) + h->index_size != dict->map_len) {
+        fprintf(stderr, "%s is not a valid compiled dictionary\n", dict->filename);
+        exit(1);
+    }
+    dict->size = h->num_words;
+    dict->num_blocks = h->num_blocks;
+    dict->blocks = (const uint32_t *) (dict->map + sizeof(*h));
+    dict->data = dict->map + sizeof(*h) + table_len;
+    dict->index = dict->map + dict_index_offset(h);
+    dict->buckets = (const struct dict_bucket *) dict->index;
+    if (!valid_blocks(dict, h->data_size) || !valid_index(dict, h)) {
+        fprintf(stderr, "%s is not a valid compiled dictionary\n", dict->filename);
+        exit(1);
+    }
+}
+
+/* Open the dictionary in filename, which is either a text file with one word
+ * per line or a dictionary compiled by mkdict.
+ */
+void dict_open(struct dictionary *dict, char *filename) {
+    char magic[4];
+
+    dict->filename = filename;
+    dict->fp = NULL;
+    dict->map = NULL;
+    dict->index = NULL;
+    dict->buckets = NULL;
+
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        perror("Opening dictionary");
+        exit(1);
+    }
+    if (read(fd, magic, sizeof(magic)) == sizeof(magic) &&
+        memcmp(magic, DICT_MAGIC, sizeof(magic)) == 0) {
+        map_compiled(dict, fd);
+        close(fd);
+        return;
+    }
+    close(fd);
+
+    // Set up the file pointer once because we want to just rewind the
+    // file when we need to pick a new word
+    dict->size = get_file_length(filename);
+    dict->fp = fopen(filename, "r");
+    if (dict->fp == NULL) {
+        perror("Opening dictionary");
+        exit(1);
+    }
+}
+
+void dict_close(struct dictionary *dict) {
+    if (dict->fp != NULL) {
+        fclose(dict->fp);
+        dict->fp = NULL;
+    }
+    if (dict->map != NULL) {
+        munmap((void *) dict->map, dict->map_len);
+        dict->map = NULL;
+        dict->index = NULL;
+        dict->buckets = NULL;
+    }
+}
+
+
+/* Decode the word at p, whose first prefix bytes are shared with the
+ * previous word already in word, and return a pointer to the next word.
+ */
+static const unsigned char *decode_word(const unsigned char *p, char *word) {
+    int prefix = p[0];
+    int len = p[1];
+    if (prefix + len >= MAX_WORD) {
+        fprintf(stderr, "Compiled dictionary contains a word that is too long\n");
+        exit(1);
+    }
+    memcpy(word + prefix, p + 2, len);
+    word[prefix + len] = '\0';
+    return p + 2 + len;
+}
+
+/* Copy the word at index into word, which must have room for MAX_WORD bytes.
+ */
+void dict_word(struct dictionary *dict, int index, char *word) {
+    if (dict->map != NULL) {
+        const unsigned char *p = dict->data + dict->blocks[index / DICT_BLOCK_SIZE];
+        for (int i = 0; i <= index % DICT_BLOCK_SIZE; i++) {
+            p = decode_word(p, word);
+        }
+        return;
+    }
+
+    char buf[MAX_WORD];
+    rewind(dict->fp);
+    for (int i = 0; i <= index; i++) {
+        if (!fgets(buf, MAX_WORD, dict->fp)) {
+            fprintf(stderr, "File ended before we found the entry index %d", index);
+            exit(1);
+        }
+    }
+
+    // Found word
+    if (buf[strlen(buf) - 1] == '\n') {  // from a unix file
+        buf[strlen(buf) - 1] = '\0';
+    } else {
+        fprintf(stderr, "The dictionary file does not appear to have Unix line endings\n");
+    }
+    strncpy(word, buf, MAX_WORD);
+    word[MAX_WORD - 1] = '\0';
+}
+
+/* Return 1 if word is in the dictionary and 0 otherwise.
+ */
+int dict_contains(struct dictionary *dict, char *word) {
+    char buf[MAX_WORD];
+
+    if (dict->map == NULL) {
+        rewind(dict->fp);
+        while (fgets(buf, MAX_WORD, dict->fp) != NULL) {
+            buf[strcspn(buf, "\n")] = '\0';
+            if (strcmp(buf, word) == 0) {
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    /* Find the last block whose first word is not after word. */
+    int lo = 0;
+    int hi = dict->num_blocks - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        decode_word(dict->data + dict->blocks[mid], buf);
+        if (strcmp(buf, word) <= 0) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    /* Scan that block; its words are sorted too. */
+    const unsigned char *p = dict->data + dict->blocks[lo];
+    int count = dict->size - lo * DICT_BLOCK_SIZE;
+    if (count > DICT_BLOCK_SIZE) {
+        count = DICT_BLOCK_SIZE;
+    }
+    for (int i = 0; i < count; i++) {
+        p = decode_word(p, buf);
+        int cmp = strcmp(buf, word);
+        if (cmp >= 0) {
+            return cmp == 0;
+        }
+    }
+    return 0;
+}
+
+/* Call fn on every word in the dictionary, in order.
+ */
+void dict_foreach(struct dictionary *dict, void (*fn)(char *word, void *arg),
+                  void *arg) {
+    char buf[MAX_WORD];
+
+    if (dict->map == NULL) {
+        rewind(dict->fp);
+        while (fgets(buf, MAX_WORD, dict->fp) != NULL) {
+            buf[strcspn(buf, "\n")] = '\0';
+            if (buf[0] != '\0') {
+                fn(buf, arg);
+            }
+        }
+        return;
+    }
+
+    for (int b = 0; b < dict->num_blocks; b++) {
+        const unsigned char *p = dict->data + dict->blocks[b];
+        for (int i = b * DICT_BLOCK_SIZE; i < dict->size && i < (b + 1) * DICT_BLOCK_SIZE; i++) {
+            p = decode_word(p, buf);
+            fn(buf, arg);
+        }
+    }
+}
@@ -0,0 +1,83 @@
+#ifndef _DICTIONARY_H_
+#define _DICTIONARY_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* A compiled dictionary is a sorted word list, front coded in blocks of
+ * DICT_BLOCK_SIZE words: the first word of a block is stored whole and
+ * every later word as the length of the prefix it shares with the word
+ * before it followed by the rest of the word. A table of block offsets
+ * makes word i reachable by decoding at most DICT_BLOCK_SIZE words, and
+ * membership a binary search over block heads. mkdict builds the file from
+ * a text dictionary; wordsrv maps it read-only so that every process on a
+ * machine shares the same pages.
+ *
+ * After the words comes the index the bot (bot.h) searches: the words made
+ * of the letters a-z grouped by length, each with a bitmask of its letters.
+ * For every length below num_lengths it holds a struct dict_bucket, whose
+ * offsets count from the start of the index, then the bucket's masks padded
+ * with zeros to a multiple of DICT_MASK_PAD and its words packed without
+ * terminators. Being part of the mapping, the index is shared like the
+ * words instead of being built by each process.
+ *
+ * File layout (integers are little-endian uint32_t):
+ *    struct dict_header
+ *    uint32_t block_offsets[num_blocks]   offsets into the block data
+ *    block data
+ *    zeros up to a multiple of DICT_ALIGN bytes from the start of the file
+ *    struct dict_bucket buckets[num_lengths]
+ *    masks and words of each bucket
+ */
+#define DICT_MAGIC "WDIC"
+#define DICT_VERSION 2
+#define DICT_BLOCK_SIZE 16
+#define DICT_ALIGN 16
+#define DICT_MASK_PAD 4
+#define DICT_LETTERS 26
+
+struct dict_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t num_words;
+    uint32_t block_size;
+    uint32_t num_blocks;
+    uint32_t data_size;
+    uint32_t num_lengths;
+    uint32_t index_size;
+};
+
+// The indexed words of one length
+struct dict_bucket {
+    uint32_t count;
+    uint32_t masks;           // Offset of count masks, bit i set for 'a' + i
+    uint32_t letters;         // Offset of count words of the bucket's length
+    uint32_t letter_counts[DICT_LETTERS]; // Words containing each letter
+};
+
+// Information about the dictionary used to pick random word
+struct dictionary {
+    char *filename;
+    int size;                     // Number of words
+
+    FILE *fp;                     // Text dictionary, rescanned for each word
+
+    const unsigned char *map;     // Compiled dictionary mapped into memory
+    size_t map_len;
+    const uint32_t *blocks;       // Offset of each block within data
+    const unsigned char *data;
+    int num_blocks;
+    const unsigned char *index;   // Word index, or NULL for a text dictionary
+    const struct dict_bucket *buckets;
+};
+
+void dict_open(struct dictionary *dict, char *filename);
+void dict_close(struct dictionary *dict);
+void dict_word(struct dictionary *dict, int index, char *word);
+int dict_contains(struct dictionary *dict, char *word);
+void dict_foreach(struct dictionary *dict, void (*fn)(char *word, void *arg),
+                  void *arg);
+int get_file_length(char *filename);
+size_t dict_index_offset(const struct dict_header *h);
+
+#endif
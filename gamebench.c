@@ -0,0 +1,283 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "gameplay.h"
+#include "bot.h"
+
+/* Microbenchmarks for the game engine in gameplay.c.
+ * Usage: gamebench <dictionary filename>
+ *
+ * Each benchmark is run for at least MIN_NSEC and reports the time and the
+ * number of heap allocations per operation.
+ */
+
+#define MIN_NSEC 200000000L  // 0.2 seconds
+#define NUM_PLAYERS 4
+#define ROOM_SIZE 1000
+#define SOLO_WORDS 256       // Words picked ahead for the bot's games
+
+/* Count every heap allocation made by the process, including those made
+ * inside the C library, by interposing on the glibc allocator.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static long num_allocs;
+static long num_alloc_bytes;
+
+void *malloc(size_t size) {
+    num_allocs++;
+    num_alloc_bytes += size;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    num_allocs++;
+    num_alloc_bytes += nmemb * size;
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    num_allocs++;
+    num_alloc_bytes += size;
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+    __libc_free(ptr);
+}
+
+
+struct game_state game;
+struct client players[NUM_PLAYERS];
+struct game_state room;  // A crowded game for the per-player benchmarks
+struct game_state solo;  // A game for the bot to play by itself
+char solo_words[SOLO_WORDS][MAX_WORD];
+char solo_misses[SOLO_WORDS];  // A letter that is not in each word
+
+
+static long now_nsec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* Run fn(n) with a doubling n until it takes at least MIN_NSEC,
+ * then print the cost per operation and, when each operation visits
+ * several players, the cost per player.
+ */
+static void run_bench(char *name, void (*fn)(long n), int players_per_op) {
+    long n = 1;
+    long elapsed;
+    long allocs;
+    long bytes;
+
+    while (1) {
+        allocs = num_allocs;
+        bytes = num_alloc_bytes;
+        long start = now_nsec();
+        fn(n);
+        elapsed = now_nsec() - start;
+        allocs = num_allocs - allocs;
+        bytes = num_alloc_bytes - bytes;
+        if (elapsed >= MIN_NSEC) {
+            break;
+        }
+        n *= 2;
+    }
+    printf("%-20s %10ld ops %12.1f ns/op %8.2f allocs/op %10.1f B/op\n",
+           name, n, (double) elapsed / n, (double) allocs / n,
+           (double) bytes / n);
+    if (players_per_op > 1) {
+        printf("%-20s %27.2f ns/player\n", "", (double) elapsed / n / players_per_op);
+    }
+}
+
+
+static void bench_select_word(long n) {
+    char word[MAX_WORD];
+    for (long i = 0; i < n; i++) {
+        select_word(&game.dict, word);
+    }
+}
+
+static void bench_init_game(long n) {
+    for (long i = 0; i < n; i++) {
+        init_game(&game);
+    }
+}
+
+static void bench_check_good_guess(long n) {
+    for (long i = 0; i < n; i++) {
+        int letter = i % NUM_LETTERS;
+        /* Forget the guesses once every letter has been tried. */
+        if (letter == 0) {
+            memset(game.letters_guessed, 0, sizeof(game.letters_guessed));
+        }
+        check_good_guess(&game, 'a' + letter);
+    }
+}
+
+static void bench_status_message(long n) {
+    char msg[MAX_MSG];
+    for (long i = 0; i < n; i++) {
+        status_message(msg, &game);
+    }
+}
+
+/* Look up a word that is in the dictionary and one that is not. */
+static void bench_dict_contains(long n) {
+    char *words[2] = {game.word, "qqqq"};
+    for (long i = 0; i < n; i++) {
+        dict_contains(&game.dict, words[i % 2]);
+    }
+}
+
+/* Find the recipients of a message to everyone in the crowded game. */
+static void bench_broadcast(long n) {
+    static int fds[ROOM_SIZE];
+    struct game_event ev;
+    ev.to = TO_ALL;
+    ev.fd = -1;
+    for (long i = 0; i < n; i++) {
+        game_recipients(&room, &ev, fds);
+    }
+}
+
+/* Each turn moves to the next of the players in the crowded game. */
+static void bench_advance_turn(long n) {
+    for (long i = 0; i < n; i++) {
+        advance_turn(&room);
+    }
+}
+
+/* Start a new game of the bot's with the i'th of the words picked in main,
+ * the way init_game does but without the cost of picking a word, which
+ * select_word measures on its own.
+ */
+static void new_solo_game(long i) {
+    strcpy(solo.word, solo_words[i % SOLO_WORDS]);
+    solo.round++;
+    int len = strlen(solo.word);
+    memset(solo.guess, '-', len);
+    solo.guess[len] = '\0';
+    memset(solo.letters_guessed, 0, sizeof(solo.letters_guessed));
+    solo.guesses_left = MAX_GUESSES;
+}
+
+/* The bot's first letter of a new game only reads the letter counts kept
+ * for the word's length; nothing needs filtering before the first guess.
+ */
+static void bench_bot_first_letter(long n) {
+    for (long i = 0; i < n; i++) {
+        new_solo_game(i);
+        bot_choose_letter(&solo);
+    }
+}
+
+/* The bot's letter after one miss filters the whole length bucket, the
+ * most expensive turn of a game.
+ */
+static void bench_bot_first_filter(long n) {
+    for (long i = 0; i < n; i++) {
+        new_solo_game(i);
+        check_good_guess(&solo, solo_misses[i % SOLO_WORDS]);
+        bot_choose_letter(&solo);
+    }
+}
+
+/* The bot plays a game alone until it finds the word or runs out of
+ * guesses, narrowing its candidates from one turn to the next.
+ */
+static void bench_bot_game(long n) {
+    for (long i = 0; i < n; i++) {
+        new_solo_game(i);
+        while (solo.guesses_left > 0 && strcmp(solo.guess, solo.word) != 0) {
+            if (!check_good_guess(&solo, bot_choose_letter(&solo))) {
+                solo.guesses_left--;
+            }
+        }
+    }
+}
+
+/* A whole turn through the state machine, including the new game that
+ * starts whenever the guesses run out or the word is found.
+ */
+static void bench_game_guess(long n) {
+    struct game_events events;
+    char line[2] = {'\0', '\0'};
+    for (long i = 0; i < n; i++) {
+        events.count = 0;
+        line[0] = 'a' + i % NUM_LETTERS;
+        game_guess(&game, game.players[game.turn], line, &events);
+    }
+}
+
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <dictionary filename>\n", argv[0]);
+        exit(1);
+    }
+
+    srandom(0);
+    dict_open(&game.dict, argv[1]);
+    init_game(&game);
+    game.turn = -1;
+
+    /* Seat some players so that the turn and broadcast logic has work to do. */
+    struct game_events events;
+    for (int i = 0; i < NUM_PLAYERS; i++) {
+        events.count = 0;
+        players[i].fd = i + 10;
+        sprintf(players[i].name, "player%d", i);
+        game_join(&game, &players[i], &events);
+    }
+
+    solo.dict = game.dict;
+    solo.words = build_word_index(&game.dict);
+    for (int i = 0; i < SOLO_WORDS; i++) {
+        select_word(&game.dict, solo_words[i]);
+        /* Miss with the rarest letter that is not in the word. */
+        char *miss = "qjxzkvbpygfwmucldrhsnioate";
+        while (strchr(solo_words[i], *miss) != NULL) {
+            miss++;
+        }
+        solo_misses[i] = *miss;
+    }
+
+    /* A crowded game whose players are allocated one at a time, the way
+     * wordsrv accepts them.
+     */
+    room.dict = game.dict;
+    init_game(&room);
+    room.turn = -1;
+    for (int i = 0; i < ROOM_SIZE; i++) {
+        struct client *p = calloc(1, sizeof(struct client));
+        if (p == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        p->fd = i + 10;
+        sprintf(p->name, "player%d", i);
+        events.count = 0;
+        game_join(&room, p, &events);
+    }
+
+    run_bench("select_word", bench_select_word, 1);
+    run_bench("init_game", bench_init_game, 1);
+    run_bench("check_good_guess", bench_check_good_guess, 1);
+    run_bench("status_message", bench_status_message, 1);
+    run_bench("dict_contains", bench_dict_contains, 1);
+    run_bench("game_guess", bench_game_guess, 1);
+    run_bench("bot_first_letter", bench_bot_first_letter, 1);
+    run_bench("bot_first_filter", bench_bot_first_filter, 1);
+    run_bench("bot_game", bench_bot_game, 1);
+    run_bench("broadcast", bench_broadcast, ROOM_SIZE);
+    run_bench("advance_turn", bench_advance_turn, 1);
+    return 0;
+}
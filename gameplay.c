@@ -4,6 +4,8 @@
 #include <string.h>
 
 #include "gameplay.h"
+#include "bot.h"
+#include "trace.h"
 
 /* Return a status message that shows the current state of the game.
  * Assumes that the caller has allocated MAX_MSG bytes for msg.
@@ -25,73 +27,354 @@ char *status_message(char *msg, struct game_state *game) {
 }
 
 
+/* Select a random word from the dictionary and copy it into word, which
+ * must have room for MAX_WORD bytes.
+ */
+void select_word(struct dictionary *dict, char *word) {
+    dict_word(dict, random() % dict->size, word);
+}
+
+
 /* Initialize the gameboard: 
- *    - initialize dictionary
- *    - select a random word to guess from the dictionary file
+ *    - select a random word to guess from the dictionary
  *    - set guess to all dashes ('-')
  *    - initialize the other fields
- * We can't initialize head and has_next_turn because these will have
+ * We can't initialize dict, the players and turn because these will have
  * different values when we use init_game to create a new game after one
  * has already been played
  */
-void init_game(struct game_state *game, char *dict_name) {
-    char buf[MAX_WORD];
-    if (game->dict.fp != NULL) {
-        rewind(game->dict.fp);
-    } else {
-        game->dict.fp = fopen(dict_name, "r");
-        if (game->dict.fp == NULL) {
-            perror("Opening dictionary");
-            exit(1);
+void init_game(struct game_state *game) {
+    CYCLES_BEGIN(H_INIT_GAME);
+    select_word(&game->dict, game->word);
+    game->round++;
+    int len = strlen(game->word);
+    for (int j = 0; j < len; j++) {
+        game->guess[j] = '-';
+    }
+    game->guess[len] = '\0';
+
+    for (int i = 0; i < NUM_LETTERS; i++) {
+        game->letters_guessed[i] = 0;
+    }
+    game->guesses_left = MAX_GUESSES;
+    CYCLES_END(H_INIT_GAME);
+}
+
+
+/* Append an event for the players selected by to and fd.
+ * Events that do not fit in the buffer are dropped with a warning.
+ */
+static void emit(struct game_events *events, int to, int fd, char *msg) {
+    if (events->count == MAX_EVENTS) {
+        fprintf(stderr, "Event buffer full, dropping: %s", msg);
+        return;
+    }
+    struct game_event *ev = &events->list[events->count++];
+    ev->to = to;
+    ev->fd = fd;
+    strncpy(ev->msg, msg, MAX_MSG);
+    ev->msg[MAX_MSG - 1] = '\0';
+}
+
+/* Store the fds of the clients that should receive ev in fds, which must
+ * have room for one fd per player, and return how many there are.
+ */
+int game_recipients(struct game_state *game, struct game_event *ev, int *fds) {
+    int count = 0;
+    if (ev->to == TO_PLAYER) {
+        if (ev->fd >= 0) {
+            fds[count++] = ev->fd;
+        }
+        return count;
+    }
+    for (int i = 0; i < game->num_players; i++) {
+        if (game->fds[i] >= 0 && (ev->to == TO_ALL || game->fds[i] != ev->fd)) {
+            fds[count++] = game->fds[i];
         }
     }
+    return count;
+}
 
-    int index = random() % game->dict.size;
-    printf("Looking for word at index %d\n", index);
-    for (int i = 0; i <= index; i++) {
-        if (!fgets(buf, MAX_WORD, game->dict.fp)) {
-            fprintf(stderr, "File ended before we found the entry index %d", index);
-            exit(1);
+/* Return the index of the active player with fd, or -1 if there is none. */
+int find_player(struct game_state *game, int fd) {
+    for (int i = 0; i < game->num_players; i++) {
+        if (game->fds[i] == fd) {
+            return i;
         }
     }
+    return -1;
+}
 
-    // Found word
-    if (buf[strlen(buf) - 1] == '\n') {  // from a unix file
-        buf[strlen(buf) - 1] = '\0';
-    } else {
-        fprintf(stderr, "The dictionary file does not appear to have Unix line endings\n");
+/* Move the turn to the next active player, wrapping around at the end. */
+void advance_turn(struct game_state *game) {
+    /* There is no turn once the last player leaves. */
+    if (game->num_players == 0) {
+        game->turn = -1;
+    } else if (++game->turn == game->num_players) {
+        game->turn = 0;
     }
-    strncpy(game->word, buf, MAX_WORD);
-    game->word[MAX_WORD - 1] = '\0';
-    for (int j = 0; j < strlen(game->word); j++) {
-        game->guess[j] = '-';
+}
+
+/* Announce the next turn of game. */
+static void announce_turn(struct game_state *game, struct game_events *events) {
+    char msg[MAX_MSG]; // the messege container
+
+    /* Send guess message to the next player and turn message to the others. */
+    sprintf(msg, "It's %s's turn.\n", game->players[game->turn]->name);
+    emit(events, TO_PLAYER, game->fds[game->turn], GUESS_MSG);
+    emit(events, TO_OTHERS, game->fds[game->turn], msg);
+}
+
+/* Announce winner as the winner of game. */
+static void announce_winner(struct game_state *game, struct client *winner,
+                            struct game_events *events) {
+    char msg[MAX_MSG]; // the messege container
+
+    /* Send word message to all clients. */
+    sprintf(msg, "The word was %s. \n", game->word);
+    emit(events, TO_ALL, -1, msg);
+
+    /* Send winner message to the winner and the other clients. */
+    sprintf(msg, "Game over! %s won!\n\n", winner->name);
+    emit(events, TO_PLAYER, winner->fd, WIN_MSG);
+    emit(events, TO_OTHERS, winner->fd, msg);
+}
+
+/* Stop play for good: nobody gets another turn. */
+static void close_game(struct game_state *game, struct game_events *events) {
+    if (game->num_players > 0) {
+        emit(events, TO_ALL, -1, SHUTDOWN_MSG);
     }
-    game->guess[strlen(game->word)] = '\0';
+    game->over = 1;
+    game->turn = -1;
+}
 
-    for (int i = 0; i < NUM_LETTERS; i++) {
-        game->letters_guessed[i] = 0;
+/* Restart a game with a new word, unless the game is draining. */
+static void restart_game(struct game_state *game, struct game_events *events) {
+    if (game->draining) {
+        close_game(game, events);
+        return;
     }
-    game->guesses_left = MAX_GUESSES;
+    emit(events, TO_ALL, -1, NEW_GAME_MSG);
+    init_game(game);
+    TRACE_PROBE1(game_restart, game->round);
+}
+
+/* Check if the guess letter has not already been guessed and is in the word. */
+int check_good_guess(struct game_state *game, int guess) {
+    int good_guess = 0; // the indicator of good guess
 
+    /* Check if guess is in letter_guessed. */
+    if (game->letters_guessed[guess - 'a'] == 0) {
+        game->letters_guessed[guess - 'a'] = 1; // Change the indicator of this guess letter in letter_guessed. 
+        /* Check if this letter is in the word. */
+        for (int i = 0; game->word[i] != '\0'; i++) {
+            if (game->word[i] == guess) {
+                game->guess[i] = guess;
+                good_guess = 1;
+            }
+        }
+    }
+    return good_guess;
 }
 
+/* Check if the name entered by the client with fd is valid.
+ * Return 1 if it is; otherwise emit a prompt to the client and return 0.
+ */
+int check_name(struct game_state *game, int fd, char *name,
+               struct game_events *events) {
+    /* Check empty name: */
+    if (strlen(name) == 0) {
+        emit(events, TO_PLAYER, fd, EMPTY_NAME_MSG);
+        return 0;
+    }
+    /* Check duplicate name, including the bot's whether or not it is playing: */
+    if (strcmp(name, BOT_NAME) == 0) {
+        emit(events, TO_PLAYER, fd, DUPLICATE_NAME_MSG);
+        return 0;
+    }
+    for (int i = 0; i < game->num_players; i++) {
+        if (strcmp(game->players[i]->name, name) == 0) {
+            emit(events, TO_PLAYER, fd, DUPLICATE_NAME_MSG);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Add p to the end of the turn order. The caller announces the turn. */
+static void seat_player(struct game_state *game, struct client *p,
+                        struct game_events *events) {
+    char msg[MAX_MSG]; // the messege container
+
+    game->fds[game->num_players] = p->fd;
+    game->players[game->num_players] = p;
+    game->num_players++;
+
+    /* Display join message to all and status message to the new player. */
+    sprintf(msg, "%s has just joined.\n", p->name);
+    emit(events, TO_ALL, -1, msg);
+    emit(events, TO_PLAYER, p->fd, status_message(msg, game));
+
+    /* For fist active player, set him as the next turn. */
+    if (game->turn == -1) {
+        advance_turn(game);
+    }
+}
 
-/* Return the number of lines in the file
+/* Remove the active player with fd from the turn order and return it, or
+ * NULL if there is no such player. The caller announces the turn.
  */
-int get_file_length(char *filename) {
-    char buf[MAX_MSG];
-    int count = 0;
-    FILE *fp;
-    if ((fp = fopen(filename, "r")) == NULL) {
-        perror("open");
-        exit(1);
+static struct client *unseat_player(struct game_state *game, int fd,
+                                    struct game_events *events) {
+    char msg[MAX_MSG];  // the messege container
+
+    int i = find_player(game, fd);
+    if (i == -1) {
+        return NULL;
     }
+    struct client *leaving = game->players[i];
 
-    while (fgets(buf, MAX_MSG, fp) != NULL) {
-        count++;
+    /* Close the gap so that the remaining players keep their turn order. */
+    int after = game->num_players - i - 1;
+    memmove(&game->fds[i], &game->fds[i + 1], after * sizeof(game->fds[0]));
+    memmove(&game->players[i], &game->players[i + 1], after * sizeof(game->players[0]));
+    game->num_players--;
+
+    /* The player after the leaving one now sits at its index, so the turn
+     * only moves when it belonged to a later player or has to wrap around.
+     */
+    if (i < game->turn) {
+        game->turn--;
+    } else if (game->turn >= game->num_players) {
+        game->turn = -1;
+        advance_turn(game);
     }
 
-    fclose(fp);
-    return count;
+    /* Send goodbye message to all clients unless there is no active client. */
+    if (game->num_players > 0) {
+        sprintf(msg, "Goodbye %s\n", leaving->name);
+        emit(events, TO_ALL, -1, msg);
+    }
+    return leaving;
 }
 
+/* Seat the bot while exactly one person is playing and unseat it otherwise.
+ */
+static void update_bot(struct game_state *game, struct game_events *events) {
+    if (!game->bots || game->over) {
+        return;
+    }
+    int seated = (find_player(game, BOT_FD) != -1);
+    int people = game->num_players - seated;
+    if (people == 1 && !seated) {
+        if (game->words == NULL && (game->words = build_word_index(&game->dict)) == NULL) {
+            return;
+        }
+        game->bot.fd = BOT_FD;
+        strcpy(game->bot.name, BOT_NAME);
+        seat_player(game, &game->bot, events);
+    } else if (people != 1 && seated) {
+        unseat_player(game, BOT_FD, events);
+    }
+}
+
+/* Add p, whose name has passed check_name, to the end of the turn order.
+ * The caller must already have unlinked p from any other list.
+ */
+void game_join(struct game_state *game, struct client *p,
+               struct game_events *events) {
+    seat_player(game, p, events);
+    update_bot(game, events);
+    /* Announce turn whenever a player join the game, once the bot has
+     * come or gone.
+     */
+    announce_turn(game, events);
+}
+
+/* Remove the active player with fd from the game and return it, or NULL if
+ * there is no such player. The caller owns the returned client and is
+ * responsible for closing its socket.
+ */
+struct client *game_leave(struct game_state *game, int fd,
+                          struct game_events *events) {
+    struct client *leaving = unseat_player(game, fd, events);
+    if (leaving != NULL) {
+        update_bot(game, events);
+        if (game->num_players > 0 && !game->over) {
+            announce_turn(game, events);
+        }
+    }
+    return leaving;
+}
+
+/* Apply a line of input from the active player p. */
+void game_guess(struct game_state *game, struct client *p, char *line,
+                struct game_events *events) {
+    char msg[MAX_MSG]; // the messege container
+
+    /* For other players, display not turn message to mistyping players. */
+    if (game->turn == -1 || game->players[game->turn] != p) {
+        if (strlen(line) > 0) {
+            emit(events, TO_PLAYER, p->fd, NOT_TURN_MSG);
+        }
+        return;
+    }
+
+    int guess = line[0]; // the guessed letter
+
+    /* Check the validity of guess. */
+    if (strlen(line) != 1 || guess < 'a' || guess > 'z') {
+        emit(events, TO_PLAYER, p->fd, INVALID_GUESS_MSG);
+        return;
+    }
+
+    TRACE_PROBE2(guess_applied, p->fd, guess);
+
+    /* Display guesses message to all clients. */
+    sprintf(msg, "%s guesses: %c\n", p->name, guess);
+    emit(events, TO_ALL, -1, msg);
+
+    /* If it is not a good guess, */
+    if (!check_good_guess(game, guess)) {
+        sprintf(msg, "%c is not in the word\n", guess);
+        emit(events, TO_PLAYER, p->fd, msg);
+        /* Do guesses_left deccrement and turn to next player. */
+        game->guesses_left--;
+        advance_turn(game);
+        /* If there is no guesses remaining, display lose message and restart. */
+        if (game->guesses_left == 0) {
+            sprintf(msg, "No guesses left. Game over.\nThe word was %s. \n\n", game->word);
+            emit(events, TO_ALL, -1, msg);
+            restart_game(game, events);
+        }
+    }
+    /* If the word has been reached, announce the winner and restart. */
+    else if (strcmp(game->guess, game->word) == 0) {
+        announce_winner(game, p, events);
+        restart_game(game, events);
+    }
+    if (game->over) {
+        return;
+    }
+
+    /* Display status and turn message to all clients. */
+    emit(events, TO_ALL, -1, status_message(msg, game));
+    announce_turn(game, events);
+}
+
+/* Stop a draining game whose word is not finished yet, telling the players
+ * what it was.
+ */
+void game_stop(struct game_state *game, struct game_events *events) {
+    char msg[MAX_MSG]; // the messege container
+
+    if (game->over) {
+        return;
+    }
+    if (game->num_players > 0) {
+        sprintf(msg, "Out of time. The word was %s.\n", game->word);
+        emit(events, TO_ALL, -1, msg);
+    }
+    close_game(game, events);
+}
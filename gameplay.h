@@ -1,11 +1,22 @@
+#ifndef _GAMEPLAY_H_
+#define _GAMEPLAY_H_
+
 #include <netinet/in.h>
+#include <sys/select.h>
+
+#include "dictionary.h"
+
+struct word_index;
+struct candidates;
 
 #define MAX_NAME 30
-#define MAX_MSG 128
+#define MAX_MSG 256
 #define MAX_WORD 20
 #define MAX_BUF 256
 #define MAX_GUESSES 4
 #define NUM_LETTERS 26
+#define MAX_EVENTS 16
+#define MAX_PLAYERS FD_SETSIZE  // select() can't watch more clients than this
 #define WELCOME_MSG "Welcome to our word game. What is your name? "
 #define INVALID_GUESS_MSG "Please enter a valid guess between 'a' and 'z': "
 #define NOT_TURN_MSG "It is not your turn to guess.\n"
@@ -13,20 +24,33 @@
 #define DUPLICATE_NAME_MSG "This user name has been used! Please enter again: "
 #define GUESS_MSG "Your Guess?\n"
 #define WIN_MSG "Game over! You win!\n\n"
+#define NEW_GAME_MSG "Let's start a new game\n"
+#define SHUTDOWN_MSG "The server is shutting down. Thanks for playing!\n"
+#define BOT_NAME "wordbot"
+#define BOT_FD -2   // Bots have no socket, so they never receive events
+
+// Recipients of a game event
+#define TO_ALL 0     // every player in the game
+#define TO_PLAYER 1  // only the client with the event's fd
+#define TO_OTHERS 2  // every player in the game except the event's fd
 
+/* The fields used on every event, and the ones the server's main loop
+ * checks for every client on every pass, come first so that they share a
+ * cache line; the name and input buffer are only touched by the owning
+ * client.
+ */
 struct client {
     int fd;
-    struct in_addr ipaddr;
+    int out_len;
+    char *outbuf;         // Output the socket could not take yet
+    int out_cap;
+    int closing;          // Disconnect once the queued output is sent
     struct client *next;
+    char *in_ptr;         // A pointer into inbuf to help with partial reads
+    size_t mem;           // Bytes of memory charged to this client
+    struct in_addr ipaddr;
     char name[MAX_NAME];
     char inbuf[MAX_BUF];  // Used to hold input from the client
-    char *in_ptr;         // A pointer into inbuf to help with partial reads
-};
-
-// Information about the dictionary used to pick random word
-struct dictionary {
-    FILE *fp;
-    int size;
 };
 
 struct game_state {
@@ -35,13 +59,63 @@ struct game_state {
     int letters_guessed[NUM_LETTERS]; // Index i will be 1 if the corresponding
     // letter has been guessed; 0 otherwise
     int guesses_left;         // Number of guesses remaining
+    unsigned int round;       // Counts the words init_game has picked
+    int draining;             // Set to stop after the current word
+    int over;                 // 1 once a draining game has stopped for good
     struct dictionary dict;
 
-    struct client *head;
-    struct client *has_next_turn;
+    /* The active players in turn order. Broadcasting and advancing the turn
+     * only need each player's fd, so the fds are kept contiguously in their
+     * own array and the rest of each client is reached through players.
+     */
+    int num_players;
+    int turn;                 // Index of the player with the next turn, or -1
+    int fds[MAX_PLAYERS];
+    struct client *players[MAX_PLAYERS];
+
+    /* The bot that keeps a lone player company, seated only while exactly
+     * one person is playing and bots is set. The word index it searches is
+     * built the first time it is seated, so that a server whose bot never
+     * plays keeps no copy of the dictionary.
+     */
+    int bots;
+    struct client bot;
+    struct word_index *words;
+    struct candidates *candidates;
+};
+
+// A message the game wants delivered to some of its players
+struct game_event {
+    int to;              // TO_ALL, TO_PLAYER or TO_OTHERS
+    int fd;              // The client the event is addressed to or excludes
+    char msg[MAX_MSG];
+};
+
+/* The game engine never writes to a socket. Each operation below appends the
+ * messages it produces to a caller-provided game_events buffer, and the
+ * caller decides how to deliver them.
+ */
+struct game_events {
+    int count;
+    struct game_event list[MAX_EVENTS];
 };
 
 
-void init_game(struct game_state *game, char *dict_name);
-int get_file_length(char *filename);
+void init_game(struct game_state *game);
+void select_word(struct dictionary *dict, char *word);
 char *status_message(char *msg, struct game_state *game);
+int game_recipients(struct game_state *game, struct game_event *ev, int *fds);
+void advance_turn(struct game_state *game);
+int find_player(struct game_state *game, int fd);
+int check_good_guess(struct game_state *game, int guess);
+int check_name(struct game_state *game, int fd, char *name,
+               struct game_events *events);
+void game_join(struct game_state *game, struct client *p,
+               struct game_events *events);
+void game_guess(struct game_state *game, struct client *p, char *line,
+                struct game_events *events);
+struct client *game_leave(struct game_state *game, int fd,
+                          struct game_events *events);
+void game_stop(struct game_state *game, struct game_events *events);
+
+#endif
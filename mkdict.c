@@ -0,0 +1,207 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "gameplay.h"
+
+/* Compile a text dictionary with one word per line into the front-coded
+ * format described in dictionary.h, with the bot's word index.
+ * Usage: mkdict <dictionary filename> <output filename>
+ *
+ * The words are sorted and duplicates removed, so the input does not need
+ * to be in order. The output is written to a temporary file and renamed
+ * into place, because running servers map the old file and would fault if
+ * it were truncated under them.
+ */
+
+
+static int compare_words(const void *a, const void *b) {
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/* Return the length of the prefix shared by s and t. */
+static int common_prefix(char *s, char *t) {
+    int i = 0;
+    while (s[i] != '\0' && s[i] == t[i]) {
+        i++;
+    }
+    return i;
+}
+
+/* Read every word in filename into a newly allocated, sorted array without
+ * duplicates and store the number of words in num_words.
+ */
+static char **read_words(char *filename, int *num_words) {
+    char buf[MAX_BUF];
+    int count = get_file_length(filename);
+    char **words = malloc(count * sizeof(char *));
+    FILE *fp = fopen(filename, "r");
+    if (words == NULL || fp == NULL) {
+        perror(words == NULL ? "malloc" : "open");
+        exit(1);
+    }
+
+    int n = 0;
+    while (n < count && fgets(buf, MAX_BUF, fp) != NULL) {
+        buf[strcspn(buf, "\r\n")] = '\0';
+        if (buf[0] == '\0') {
+            continue;
+        }
+        if (strlen(buf) >= MAX_WORD) {
+            fprintf(stderr, "Skipping %s: longer than %d letters\n", buf, MAX_WORD - 1);
+            continue;
+        }
+        if ((words[n] = strdup(buf)) == NULL) {
+            perror("strdup");
+            exit(1);
+        }
+        n++;
+    }
+    fclose(fp);
+
+    qsort(words, n, sizeof(char *), compare_words);
+    int unique = 0;
+    for (int i = 0; i < n; i++) {
+        if (unique == 0 || strcmp(words[i], words[unique - 1]) != 0) {
+            words[unique++] = words[i];
+        }
+    }
+    *num_words = unique;
+    return words;
+}
+
+/* Return 1 if word is made only of the letters a-z and so can be indexed. */
+static int indexable(char *word) {
+    return strspn(word, "abcdefghijklmnopqrstuvwxyz") == strlen(word);
+}
+
+/* Build the word index of the sorted words, as laid out in dictionary.h,
+ * in a newly allocated buffer and store its size in size.
+ */
+static unsigned char *build_index(char **words, int num_words, uint32_t *size) {
+    struct dict_bucket buckets[MAX_WORD];
+    memset(buckets, 0, sizeof(buckets));
+    for (int i = 0; i < num_words; i++) {
+        if (indexable(words[i])) {
+            buckets[strlen(words[i])].count++;
+        }
+    }
+
+    /* Lay out each bucket's masks, padded for vector reads, then its words. */
+    uint32_t end = sizeof(buckets);
+    for (int len = 1; len < MAX_WORD; len++) {
+        uint32_t padded = (buckets[len].count + DICT_MASK_PAD - 1) /
+            DICT_MASK_PAD * DICT_MASK_PAD;
+        buckets[len].masks = end;
+        buckets[len].letters = end + padded * sizeof(uint32_t);
+        end = buckets[len].letters + buckets[len].count * len;
+        end = (end + DICT_ALIGN - 1) / DICT_ALIGN * DICT_ALIGN;
+        buckets[len].count = 0;
+    }
+
+    unsigned char *index = calloc(1, end);
+    if (index == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for (int i = 0; i < num_words; i++) {
+        if (!indexable(words[i])) {
+            continue;
+        }
+        int len = strlen(words[i]);
+        struct dict_bucket *b = &buckets[len];
+        uint32_t mask = 0;
+        for (int j = 0; j < len; j++) {
+            mask |= 1u << (words[i][j] - 'a');
+        }
+        memcpy(index + b->masks + b->count * sizeof(uint32_t), &mask, sizeof(mask));
+        memcpy(index + b->letters + b->count * len, words[i], len);
+        for (int l = 0; l < DICT_LETTERS; l++) {
+            b->letter_counts[l] += (mask >> l) & 1;
+        }
+        b->count++;
+    }
+    memcpy(index, buckets, sizeof(buckets));
+    *size = end;
+    return index;
+}
+
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <dictionary filename> <output filename>\n", argv[0]);
+        exit(1);
+    }
+
+    int num_words;
+    char **words = read_words(argv[1], &num_words);
+    if (num_words == 0) {
+        fprintf(stderr, "%s has no words\n", argv[1]);
+        exit(1);
+    }
+
+    struct dict_header h;
+    memcpy(h.magic, DICT_MAGIC, sizeof(h.magic));
+    h.version = DICT_VERSION;
+    h.num_words = num_words;
+    h.block_size = DICT_BLOCK_SIZE;
+    h.num_blocks = (num_words + DICT_BLOCK_SIZE - 1) / DICT_BLOCK_SIZE;
+
+    /* Each word takes at most two length bytes plus its letters. */
+    uint32_t *blocks = malloc(h.num_blocks * sizeof(uint32_t));
+    unsigned char *data = malloc((size_t) num_words * (MAX_WORD + 2));
+    if (blocks == NULL || data == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    uint32_t size = 0;
+    for (int i = 0; i < num_words; i++) {
+        int prefix = 0;
+        if (i % DICT_BLOCK_SIZE == 0) {
+            blocks[i / DICT_BLOCK_SIZE] = size;
+        } else {
+            prefix = common_prefix(words[i - 1], words[i]);
+        }
+        int len = strlen(words[i]) - prefix;
+        data[size++] = prefix;
+        data[size++] = len;
+        memcpy(data + size, words[i] + prefix, len);
+        size += len;
+    }
+    h.data_size = size;
+    h.num_lengths = MAX_WORD;
+    uint32_t index_size;
+    unsigned char *index = build_index(words, num_words, &index_size);
+    h.index_size = index_size;
+    size_t padding = dict_index_offset(&h) -
+        (sizeof(h) + h.num_blocks * sizeof(uint32_t) + size);
+    char zeros[DICT_ALIGN] = {0};
+
+    char tmp[MAX_BUF];
+    snprintf(tmp, MAX_BUF, "%s.%d.tmp", argv[2], (int) getpid());
+    FILE *out = fopen(tmp, "w");
+    if (out == NULL) {
+        perror("open");
+        exit(1);
+    }
+    if (fwrite(&h, sizeof(h), 1, out) != 1 ||
+        fwrite(blocks, sizeof(uint32_t), h.num_blocks, out) != h.num_blocks ||
+        fwrite(data, 1, size, out) != size ||
+        fwrite(zeros, 1, padding, out) != padding ||
+        fwrite(index, 1, index_size, out) != index_size || fclose(out) != 0) {
+        perror("write");
+        unlink(tmp);
+        exit(1);
+    }
+    if (rename(tmp, argv[2]) == -1) {
+        perror("rename");
+        unlink(tmp);
+        exit(1);
+    }
+
+    printf("Compiled %d words into %lu bytes\n", num_words,
+           (unsigned long) (dict_index_offset(&h) + index_size));
+    return 0;
+}
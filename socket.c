@@ -70,8 +70,8 @@ int set_up_server_socket(struct sockaddr_in *self, int num_queue) {
 
 /*
  * Wait for and accept a new connection.
- * Terminate with exit code 1 if the accept call failed, otherwise return
- * the client's socket descriptor.
+ * Return -1 if the accept call failed, otherwise return the client's
+ * socket descriptor.
  */
 int accept_connection(int listenfd) {
     struct sockaddr_in peer;
@@ -82,7 +82,7 @@ int accept_connection(int listenfd) {
     int client_socket = accept(listenfd, (struct sockaddr *)&peer, &peer_len);
     if (client_socket < 0) {
         perror("accept");
-        exit(1);
+        return -1;
     } else {
         printf("New connection accepted from %s:%d\n",
             inet_ntoa(peer.sin_addr),
@@ -0,0 +1,56 @@
+#include <stdio.h>
+#include <time.h>
+
+#include "trace.h"
+
+#ifndef NO_TRACE
+
+static char *handler_names[NUM_HANDLERS] = {
+    "select", "accept", "read", "line", "init_game",
+    "deliver", "flush", "bot", "shed"
+};
+
+uint64_t trace_iteration[NUM_HANDLERS];  // Cycles in the current iteration
+uint64_t trace_calls[NUM_HANDLERS];
+
+static uint64_t total_cycles[NUM_HANDLERS];
+static uint64_t max_iteration[NUM_HANDLERS];
+static uint64_t iterations;
+
+#if !defined(__x86_64__) && !defined(__i386__)
+/* Without a cycle counter, count nanoseconds instead. */
+uint64_t trace_cycles(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#endif
+
+/* Add the cycles of the event loop iteration that just finished to the
+ * totals and start counting the next one.
+ */
+void trace_end_iteration(void) {
+    iterations++;
+    for (int h = 0; h < NUM_HANDLERS; h++) {
+        total_cycles[h] += trace_iteration[h];
+        if (trace_iteration[h] > max_iteration[h]) {
+            max_iteration[h] = trace_iteration[h];
+        }
+        trace_iteration[h] = 0;
+    }
+}
+
+/* Print the cycles spent in each handler since the server started. */
+void trace_dump(void) {
+    fprintf(stderr, "%lu event loop iterations\n", (unsigned long) iterations);
+    fprintf(stderr, "%-10s %12s %16s %12s %16s\n", "handler", "calls",
+            "cycles", "cycles/call", "max/iteration");
+    for (int h = 0; h < NUM_HANDLERS; h++) {
+        fprintf(stderr, "%-10s %12lu %16lu %12lu %16lu\n", handler_names[h],
+                (unsigned long) trace_calls[h], (unsigned long) total_cycles[h],
+                (unsigned long) (trace_calls[h] ? total_cycles[h] / trace_calls[h] : 0),
+                (unsigned long) max_iteration[h]);
+    }
+}
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+
+/* Hot-path instrumentation for wordsrv.
+ *
+ * TRACE_PROBE* places a USDT probe (provider "wordsrv") that bpftrace,
+ * perf or SystemTap can attach to, e.g.
+ *    bpftrace -e 'usdt:./wordsrv:wordsrv:guess_applied { @[arg1] = count(); }'
+ * Probes cost a single nop until attached. They need <sys/sdt.h>
+ * (systemtap-sdt-dev); without it they compile to nothing.
+ *
+ * CYCLES_BEGIN/CYCLES_END count the CPU cycles (rdtsc on x86, nanoseconds
+ * elsewhere) spent in each handler of the event loop. Counts are inclusive,
+ * so a handler that calls another is charged for both. trace_end_iteration
+ * folds each loop iteration into the totals and records the worst
+ * iteration per handler; trace_dump prints them, which wordsrv does on
+ * SIGUSR1.
+ *
+ * Building with -DNO_TRACE (make release) compiles all of it out.
+ */
+
+enum trace_handler {
+    H_SELECT,       // Waiting in select
+    H_ACCEPT,       // Accepting and greeting a new client
+    H_READ,         // Reading from a client's socket
+    H_LINE,         // Acting on a line of input, including delivery
+    H_INIT_GAME,    // Picking a word and resetting the board
+    H_DELIVER,      // Writing events to their recipients
+    H_FLUSH,        // Writing queued output
+    H_BOT,          // Choosing the bot's letters
+    H_SHED,         // Checking memory budgets and dropping clients
+    NUM_HANDLERS
+};
+
+#ifndef NO_TRACE
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE_PROBE1(name, a) STAP_PROBE1(wordsrv, name, a)
+#define TRACE_PROBE2(name, a, b) STAP_PROBE2(wordsrv, name, a, b)
+#endif
+#endif
+#ifndef TRACE_PROBE1
+#define TRACE_PROBE1(name, a) do { } while (0)
+#define TRACE_PROBE2(name, a, b) do { } while (0)
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define trace_cycles() __rdtsc()
+#else
+uint64_t trace_cycles(void);
+#endif
+
+extern uint64_t trace_iteration[NUM_HANDLERS];
+extern uint64_t trace_calls[NUM_HANDLERS];
+
+#define CYCLES_BEGIN(h) uint64_t cycles_start_##h = trace_cycles()
+#define CYCLES_END(h) do { \
+        trace_iteration[h] += trace_cycles() - cycles_start_##h; \
+        trace_calls[h]++; \
+    } while (0)
+
+void trace_end_iteration(void);
+void trace_dump(void);
+
+#else
+
+#define TRACE_PROBE1(name, a) do { } while (0)
+#define TRACE_PROBE2(name, a, b) do { } while (0)
+#define CYCLES_BEGIN(h) do { } while (0)
+#define CYCLES_END(h) do { } while (0)
+#define trace_end_iteration() do { } while (0)
+#define trace_dump() do { } while (0)
+
+#endif
+
+#endif
@@ -0,0 +1,922 @@
+#define _GNU_SOURCE         /* splice */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "socket.h"
+#include "gameplay.h"
+
+/* A front end that spreads games across several wordsrv nodes.
+ * Usage: wordrouter [-p port] <nodes filename>
+ *
+ * The nodes file lists one backend per line as host:port; lines starting
+ * with '#' are ignored. The router asks each new client for its name, which
+ * may name a room as "name@room". Players who don't name one fill numbered
+ * lobbies (lobby-1, lobby-2, ...) LOBBY_SIZE at a time, so that they spread
+ * across the nodes as they arrive. The room is hashed onto a consistent hash
+ * ring of the healthy nodes, and the router connects to the node that owns it, answers the
+ * node's welcome with the player's name and from then on moves bytes between
+ * the two sockets with splice(), so the game traffic is never copied through
+ * the router.
+ *
+ * A room only picks a node. Each wordsrv runs a single game, so every room
+ * that hashes to the same node plays in that node's game; what the room
+ * guarantees is that players who name the same one always play together.
+ *
+ * Nodes are health checked every HEALTH_INTERVAL seconds: a node answers if
+ * it accepts a connection and greets it with WELCOME_MSG within
+ * CONNECT_TIMEOUT. A node that fails to answer MAX_MISSES times in a row,
+ * counting the connections made for players, is taken off the ring; one that
+ * refuses a connection is taken off at once. Health checks and connections
+ * for players are made without blocking and finished by the main select
+ * loop, so a node that doesn't answer never holds up the games relayed to
+ * the others. Sending the router SIGHUP rereads the nodes file.
+ *
+ * Whenever the ring changes, because a node was added, removed, went down or
+ * came back, every player whose room now hashes to another node is
+ * reconnected to the room's new owner under the same name, so a room never
+ * stays split across two nodes. When a node closes a player's connection the
+ * node is checked again first: if it still answers it dropped that player on
+ * purpose (wordsrv sheds slow clients and drains), so the player is
+ * disconnected rather than moved.
+ */
+
+#ifndef PORT
+#define PORT y
+#endif
+#define MAX_QUEUE 5
+#define MAX_NODES 32
+#define MAX_HOST 64
+#define VNODES 64            // Points on the hash ring per node
+#define HEALTH_INTERVAL 2    // Seconds between health checks
+#define CONNECT_TIMEOUT 500  // Milliseconds to wait for a node to answer
+#define MAX_MISSES 2         // Unanswered connections before a node is down
+#define RELAY_CHUNK 65536
+#define LOBBY_ROOM "lobby-%d"
+#define LOBBY_SIZE 16        // Players in a lobby before the next one opens
+#define NO_NODE_MSG "No game servers are available right now. Goodbye.\r\n"
+#define MOVED_MSG "Your game has moved to another server.\r\n"
+#define BUSY_MSG "The server is busy. Please try again later.\r\n"
+
+struct node {
+    char host[MAX_HOST];
+    int port;
+    struct sockaddr_in addr;
+    int configured;          // Listed in the nodes file
+    int healthy;             // On the ring
+    int misses;              // Connections it failed to answer in a row
+    int added;               // Configured by the last reload of the file
+    int check_fd;            // Socket of the health check in progress, or -1
+    int check_got;           // Bytes of the welcome it has read
+    long check_deadline;     // When the check fails, in milliseconds
+};
+
+struct ring_point {
+    unsigned int hash;
+    int node;
+};
+
+// The stages of a session
+#define NAMING 0             // Waiting for the player's name
+#define CONNECTING 1         // Waiting for the node's welcome
+#define PLAYING 2            // Relaying between the client and the node
+#define RECHECKING 3         // The node closed the connection; checking it
+
+struct session {
+    int state;
+    int client_fd;
+    int node_fd;             // -1 until the player has given a name
+    int node;                // Index in nodes of the node serving the player
+    int greeted;             // Bytes of the node's welcome read so far
+    long deadline;           // When connecting to the node fails
+    int moved;               // 1 if the player came from another node
+    char name[MAX_NAME];
+    char room[MAX_NAME];
+    char inbuf[MAX_BUF];     // The client's input before it has a node
+    int in_len;
+    int to_node[2];          // Pipes for splicing each direction
+    int to_client[2];
+    int to_node_len;         // Bytes waiting in each pipe for their socket
+    int to_client_len;
+    struct session *next;
+};
+
+struct node nodes[MAX_NODES];
+int num_nodes;
+struct ring_point ring[MAX_NODES * VNODES];
+int ring_size;
+
+struct session *sessions;
+char *nodes_file;
+int ring_changed;            // Sessions may need moving to their room's owner
+
+volatile sig_atomic_t reload_requested;
+
+
+/* 32-bit FNV-1a hash of s, finished with MurmurHash3's final mix so that
+ * keys differing only in their last character spread around the ring.
+ */
+unsigned int hash_string(char *s) {
+    unsigned int h = 2166136261u;
+    for (; *s; s++) {
+        h = (h ^ (unsigned char) *s) * 16777619u;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+int compare_points(const void *a, const void *b) {
+    unsigned int x = ((const struct ring_point *) a)->hash;
+    unsigned int y = ((const struct ring_point *) b)->hash;
+    return x < y ? -1 : x > y;
+}
+
+/* Rebuild the hash ring from the nodes that are configured and healthy. */
+void build_ring() {
+    char key[MAX_HOST + 32];
+
+    ring_size = 0;
+    for (int i = 0; i < num_nodes; i++) {
+        if (!nodes[i].configured || !nodes[i].healthy) {
+            continue;
+        }
+        for (int v = 0; v < VNODES; v++) {
+            sprintf(key, "%s:%d#%d", nodes[i].host, nodes[i].port, v);
+            ring[ring_size].hash = hash_string(key);
+            ring[ring_size].node = i;
+            ring_size++;
+        }
+    }
+    qsort(ring, ring_size, sizeof(ring[0]), compare_points);
+    ring_changed = 1;
+}
+
+/* Return the node that owns room, or -1 if no node is available. */
+int lookup_room(char *room) {
+    if (ring_size == 0) {
+        return -1;
+    }
+    unsigned int h = hash_string(room);
+    int lo = 0;
+    int hi = ring_size;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (ring[mid].hash < h) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return ring[lo == ring_size ? 0 : lo].node;
+}
+
+
+/* Return the time in milliseconds since some fixed point. */
+long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/* Start connecting to n without waiting for the connection to complete.
+ * Return the socket, -1 if the router is out of descriptors, or -2 if the
+ * node refused the connection straight away.
+ */
+int open_node(struct node *n) {
+    int fd = socket(PF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+    if (fd >= FD_SETSIZE) {
+        fprintf(stderr, "Can't reach %s:%d: too many descriptors\n", n->host, n->port);
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    if (connect(fd, (struct sockaddr *) &n->addr, sizeof(n->addr)) == -1 &&
+        errno != EINPROGRESS) {
+        close(fd);
+        return -2;
+    }
+    return fd;
+}
+
+/* Read what has arrived of the welcome a node sends on fd, *got bytes of
+ * which were read before. Return 1 once all of it has arrived, 0 while
+ * more is to come, and -1 if the connection failed or the node said
+ * something else.
+ */
+int read_welcome(int fd, int *got) {
+    char buf[sizeof(WELCOME_MSG)];
+    int len = strlen(WELCOME_MSG);
+
+    int n = read(fd, buf, len - *got);
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
+    }
+    if (n <= 0 || memcmp(buf, WELCOME_MSG + *got, n) != 0) {
+        return -1;
+    }
+    *got += n;
+    return *got == len;
+}
+
+/* Record whether node i is serving games, rebuilding the ring if that
+ * changed.
+ */
+void set_health(int i, int healthy) {
+    if (healthy != nodes[i].healthy) {
+        printf("Node %s:%d is %s\n", nodes[i].host, nodes[i].port,
+               healthy ? "up" : "down");
+        nodes[i].healthy = healthy;
+        build_ring();
+    }
+}
+
+/* Record that node i answered a connection, or failed to. A node is taken
+ * off the ring after MAX_MISSES failures in a row, so that one slow answer
+ * doesn't move its rooms.
+ */
+void node_answered(int i, int answered) {
+    if (answered) {
+        nodes[i].misses = 0;
+        set_health(i, nodes[i].configured);
+    } else if (++nodes[i].misses >= MAX_MISSES) {
+        set_health(i, 0);
+    }
+}
+
+void finish_check(int i, int healthy);
+
+/* Start a health check of node i; the main loop finishes it. */
+void start_check(int i) {
+    int fd = open_node(&nodes[i]);
+    if (fd == -2) {
+        finish_check(i, 0);
+    } else if (fd != -1) {
+        nodes[i].check_fd = fd;
+        nodes[i].check_got = 0;
+        nodes[i].check_deadline = now_ms() + CONNECT_TIMEOUT;
+    }
+}
+
+/* Start checking every configured node that isn't being checked already. */
+void check_health() {
+    for (int i = 0; i < num_nodes; i++) {
+        if (nodes[i].configured && nodes[i].check_fd == -1) {
+            start_check(i);
+        }
+    }
+}
+
+/* Return 1 if a health check is in progress. */
+int checking() {
+    for (int i = 0; i < num_nodes; i++) {
+        if (nodes[i].check_fd != -1) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Read the nodes file, marking nodes that are no longer listed as removed
+ * and nodes that are newly listed as added.
+ */
+void load_nodes() {
+    char line[MAX_BUF];
+    char host[MAX_HOST];
+    int port;
+
+    FILE *fp = fopen(nodes_file, "r");
+    if (fp == NULL) {
+        perror("Opening nodes file");
+        return;
+    }
+    for (int i = 0; i < num_nodes; i++) {
+        nodes[i].added = !nodes[i].configured;
+        nodes[i].configured = 0;
+    }
+
+    while (fgets(line, MAX_BUF, fp) != NULL) {
+        if (line[0] == '#' || sscanf(line, "%63[^:\n]:%d", host, &port) != 2) {
+            continue;
+        }
+        int i;
+        for (i = 0; i < num_nodes; i++) {
+            if (strcmp(nodes[i].host, host) == 0 && nodes[i].port == port) {
+                break;
+            }
+        }
+        if (i == num_nodes) {
+            struct hostent *he = gethostbyname(host);
+            if (he == NULL || num_nodes == MAX_NODES) {
+                fprintf(stderr, "Ignoring node %s:%d\n", host, port);
+                continue;
+            }
+            num_nodes++;
+            strcpy(nodes[i].host, host);
+            nodes[i].port = port;
+            nodes[i].addr.sin_family = PF_INET;
+            nodes[i].addr.sin_port = htons(port);
+            memcpy(&nodes[i].addr.sin_addr, he->h_addr_list[0], sizeof(struct in_addr));
+            memset(&nodes[i].addr.sin_zero, 0, 8);
+            nodes[i].healthy = 0;
+            nodes[i].misses = 0;
+            nodes[i].added = 1;
+            nodes[i].check_fd = -1;
+        }
+        nodes[i].configured = 1;
+    }
+    fclose(fp);
+
+    for (int i = 0; i < num_nodes; i++) {
+        nodes[i].added = nodes[i].added && nodes[i].configured;
+        if (nodes[i].added) {
+            printf("Node %s:%d added\n", nodes[i].host, nodes[i].port);
+        } else if (!nodes[i].configured && nodes[i].healthy) {
+            printf("Node %s:%d removed\n", nodes[i].host, nodes[i].port);
+            nodes[i].healthy = 0;
+        }
+    }
+}
+
+
+/* Append len bytes of buf to the pipe p, which holds *pending bytes.
+ * Return -1 if the pipe is full.
+ */
+int queue_bytes(int p[2], int *pending, char *buf, int len) {
+    if (len == 0) {
+        return 0;
+    }
+    int n = write(p[1], buf, len);
+    if (n > 0) {
+        *pending += n;
+    }
+    return n == len ? 0 : -1;
+}
+
+#define RELAY_OK 0
+#define RELAY_FROM_CLOSED 1
+#define RELAY_TO_CLOSED 2
+
+/* Move whatever is waiting on the socket from into the pipe p, which holds
+ * *pending bytes, without copying it into user space.
+ */
+int fill_pipe(int from, int p[2], int *pending) {
+    ssize_t n = splice(from, NULL, p[1], NULL, RELAY_CHUNK,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n == -1 && errno == EAGAIN) {
+        return RELAY_OK;
+    }
+    if (n <= 0) {
+        return RELAY_FROM_CLOSED;
+    }
+    *pending += n;
+    return RELAY_OK;
+}
+
+/* Move as much of the pipe p as the socket to will take. The rest stays in
+ * the pipe until select finds to writable, so a client that stops reading
+ * only holds up its own session.
+ */
+int empty_pipe(int to, int p[2], int *pending) {
+    while (*pending > 0) {
+        ssize_t sent = splice(p[0], NULL, to, NULL, *pending,
+                              SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (sent == -1 && errno == EAGAIN) {
+            return RELAY_OK;
+        }
+        if (sent <= 0) {
+            return RELAY_TO_CLOSED;
+        }
+        *pending -= sent;
+    }
+    return RELAY_OK;
+}
+
+/* Throw away whatever is waiting in the pipe p. */
+void discard_pipe(int p[2], int *pending) {
+    char buf[MAX_BUF];
+    while (*pending > 0 && read(p[0], buf, sizeof(buf)) > 0);
+    *pending = 0;
+}
+
+/* Close both pipes and sockets of s, remove it from sessions and free it. */
+void remove_session(struct session *s) {
+    struct session **p;
+
+    for (p = &sessions; *p != s; p = &(*p)->next);
+    *p = s->next;
+    printf("Closing session for %s\n", s->name[0] ? s->name : "unnamed client");
+    close(s->client_fd);
+    if (s->node_fd != -1) {
+        close(s->node_fd);
+    }
+    close(s->to_node[0]);
+    close(s->to_node[1]);
+    close(s->to_client[0]);
+    close(s->to_client[1]);
+    free(s);
+}
+
+/* Start connecting s to the node that owns its room; the player's name is
+ * sent once the node has welcomed it. Return -1 if no node can take the
+ * player.
+ */
+int route_session(struct session *s) {
+    if (s->node_fd != -1) {
+        close(s->node_fd);
+        s->node_fd = -1;
+    }
+    /* Input meant for the previous node is no use to the next one. */
+    discard_pipe(s->to_node, &s->to_node_len);
+
+    while ((s->node = lookup_room(s->room)) != -1) {
+        int fd = open_node(&nodes[s->node]);
+        if (fd == -1) {
+            s->node = -1;
+            return -1;
+        }
+        if (fd >= 0) {
+            s->node_fd = fd;
+            break;
+        }
+        /* The node died since the last health check; stop routing to it. */
+        set_health(s->node, 0);
+    }
+    if (s->node == -1) {
+        return -1;
+    }
+
+    printf("Routing %s in room %s to %s:%d\n", s->name, s->room,
+           nodes[s->node].host, nodes[s->node].port);
+    s->state = CONNECTING;
+    s->greeted = 0;
+    s->deadline = now_ms() + CONNECT_TIMEOUT;
+    return 0;
+}
+
+/* Route s again, or say goodbye if no node can take the player. */
+void reroute_session(struct session *s) {
+    if (route_session(s) == -1) {
+        write(s->client_fd, NO_NODE_MSG, strlen(NO_NODE_MSG));
+        remove_session(s);
+    }
+}
+
+/* Move s to the current owner of its room. */
+void migrate_session(struct session *s) {
+    s->moved = s->moved || s->state == PLAYING;
+    reroute_session(s);
+}
+
+/* Answer the welcome of the node s has connected to with the player's name
+ * and start relaying. Return -1 if the name can't be queued.
+ */
+int start_playing(struct session *s) {
+    char line[MAX_NAME + 2];
+
+    sprintf(line, "%s\r\n", s->name);
+    /* Pass on anything the client typed after its name. */
+    if (queue_bytes(s->to_node, &s->to_node_len, line, strlen(line)) == -1 ||
+        queue_bytes(s->to_node, &s->to_node_len, s->inbuf, s->in_len) == -1) {
+        return -1;
+    }
+    s->in_len = 0;
+    if (s->moved) {
+        queue_bytes(s->to_client, &s->to_client_len, MOVED_MSG, strlen(MOVED_MSG));
+        s->moved = 0;
+    }
+    s->state = PLAYING;
+    return 0;
+}
+
+/* Finish the health check of node i. The players whose connection the node
+ * closed are disconnected if it answered and moved if it didn't.
+ */
+void finish_check(int i, int healthy) {
+    if (nodes[i].check_fd != -1) {
+        close(nodes[i].check_fd);
+        nodes[i].check_fd = -1;
+    }
+    node_answered(i, healthy);
+
+    struct session *s = sessions;
+    while (s) {
+        struct session *next = s->next;
+        if (s->state == RECHECKING && s->node == i) {
+            if (healthy && nodes[i].healthy) {
+                printf("%s:%d closed the connection of %s\n", nodes[i].host,
+                       nodes[i].port, s->name);
+                empty_pipe(s->client_fd, s->to_client, &s->to_client_len);
+                remove_session(s);
+            } else {
+                migrate_session(s);
+            }
+        }
+        s = next;
+    }
+}
+
+/* Move every player whose room is owned by another node since the ring last
+ * changed to the room's owner, and every player whose node was removed. The
+ * players of a node that went down stay put while no node can take them.
+ */
+void rebalance() {
+    ring_changed = 0;
+    struct session *s = sessions;
+    while (s) {
+        struct session *next = s->next;
+        if (s->state == PLAYING || s->state == CONNECTING) {
+            int owner = lookup_room(s->room);
+            if (!nodes[s->node].configured || (owner != -1 && owner != s->node)) {
+                migrate_session(s);
+            }
+        }
+        s = next;
+    }
+}
+
+/* The node of s closed the connection or stopped taking input. That may be
+ * the node dropping this one player on purpose, so check the node again
+ * before deciding; finish_check disconnects or moves the player.
+ */
+void recheck_session(struct session *s) {
+    printf("Lost the connection of %s to %s:%d\n", s->name,
+           nodes[s->node].host, nodes[s->node].port);
+    close(s->node_fd);
+    s->node_fd = -1;
+    discard_pipe(s->to_node, &s->to_node_len);
+    s->state = RECHECKING;
+    if (nodes[s->node].check_fd == -1) {
+        start_check(s->node);
+    }
+}
+
+/* Reread the nodes file and check the nodes that were added. rebalance
+ * moves the players whose node was removed.
+ */
+void reload_nodes() {
+    load_nodes();
+    build_ring();
+    check_health();
+}
+
+
+/* Accept a new client, create its session and ask for its name. A client
+ * the router has no room for is turned away instead.
+ */
+void add_session(int listenfd) {
+    int fd = accept_connection(listenfd);
+    if (fd == -1) {
+        return;
+    }
+    /* select can only watch descriptors below FD_SETSIZE. */
+    if (fd >= FD_SETSIZE) {
+        fprintf(stderr, "Refusing client %d: too many descriptors\n", fd);
+        write(fd, BUSY_MSG, strlen(BUSY_MSG));
+        close(fd);
+        return;
+    }
+    struct session *s = malloc(sizeof(struct session));
+    if (!s) {
+        perror("malloc");
+        write(fd, BUSY_MSG, strlen(BUSY_MSG));
+        close(fd);
+        return;
+    }
+    if (pipe2(s->to_node, O_NONBLOCK) == -1) {
+        perror("pipe");
+        write(fd, BUSY_MSG, strlen(BUSY_MSG));
+        close(fd);
+        free(s);
+        return;
+    }
+    if (pipe2(s->to_client, O_NONBLOCK) == -1) {
+        perror("pipe");
+        write(fd, BUSY_MSG, strlen(BUSY_MSG));
+        close(fd);
+        close(s->to_node[0]);
+        close(s->to_node[1]);
+        free(s);
+        return;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    s->state = NAMING;
+    s->client_fd = fd;
+    s->node_fd = -1;
+    s->moved = 0;
+    s->to_node_len = 0;
+    s->to_client_len = 0;
+    s->node = -1;
+    s->name[0] = '\0';
+    s->in_len = 0;
+    s->next = sessions;
+    sessions = s;
+    if (write(fd, WELCOME_MSG, strlen(WELCOME_MSG)) == -1) {
+        remove_session(s);
+    }
+}
+
+/* Put the name of the first lobby with room for another player in room. */
+void pick_lobby(char *room) {
+    for (int k = 1; ; k++) {
+        int players = 0;
+        sprintf(room, LOBBY_ROOM, k);
+        for (struct session *s = sessions; s; s = s->next) {
+            if (s->state != NAMING && strcmp(s->room, room) == 0) {
+                players++;
+            }
+        }
+        if (players < LOBBY_SIZE) {
+            return;
+        }
+    }
+}
+
+/* Read from a client that has not given its name yet. Once a full line has
+ * arrived, parse "name" or "name@room" and route the player.
+ */
+void read_name(struct session *s) {
+    int n = read(s->client_fd, s->inbuf + s->in_len, MAX_BUF - 1 - s->in_len);
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;
+    }
+    if (n <= 0) {
+        remove_session(s);
+        return;
+    }
+    s->in_len += n;
+    s->inbuf[s->in_len] = '\0';
+
+    char *end = strstr(s->inbuf, "\r\n");
+    if (end == NULL) {
+        if (s->in_len == MAX_BUF - 1) {
+            remove_session(s);  // A name can't be this long
+        }
+        return;
+    }
+    *end = '\0';
+
+    char *room = strchr(s->inbuf, '@');
+    if (room != NULL) {
+        *room++ = '\0';
+    }
+    if (strlen(s->inbuf) == 0 || strlen(s->inbuf) >= MAX_NAME ||
+        (room != NULL && (strlen(room) == 0 || strlen(room) >= MAX_NAME))) {
+        s->in_len = 0;
+        if (write(s->client_fd, EMPTY_NAME_MSG, strlen(EMPTY_NAME_MSG)) == -1) {
+            remove_session(s);
+        }
+        return;
+    }
+    strcpy(s->name, s->inbuf);
+    if (room != NULL) {
+        strcpy(s->room, room);
+    } else {
+        pick_lobby(s->room);
+    }
+
+    /* Keep whatever followed the name for the node. */
+    char *rest = end + 2;
+    s->in_len -= rest - s->inbuf;
+    memmove(s->inbuf, rest, s->in_len);
+
+    reroute_session(s);
+}
+
+/* Read the node's welcome on a session that is connecting, and start
+ * relaying once it is complete. A node that fails to answer in time counts
+ * a miss and the player is routed again, to the room's next owner once the
+ * node is off the ring.
+ */
+void connect_session(struct session *s, fd_set *rset) {
+    int status = 0;
+    if (FD_ISSET(s->node_fd, rset)) {
+        status = read_welcome(s->node_fd, &s->greeted);
+    }
+    if (status == 0 && now_ms() > s->deadline) {
+        status = -1;
+    }
+    if (status == 1) {
+        node_answered(s->node, 1);
+        if (start_playing(s) == -1) {
+            remove_session(s);
+        }
+    } else if (status == -1) {
+        printf("%s:%d did not welcome %s\n", nodes[s->node].host,
+               nodes[s->node].port, s->name);
+        node_answered(s->node, 0);
+        reroute_session(s);
+    }
+}
+
+/* Move whatever is ready in either direction of a session that is playing.
+ */
+void relay_session(struct session *s, fd_set *rset, fd_set *wset) {
+    int status = RELAY_OK;
+    if (FD_ISSET(s->client_fd, wset)) {
+        status = empty_pipe(s->client_fd, s->to_client, &s->to_client_len);
+    }
+    if (status == RELAY_OK && FD_ISSET(s->node_fd, rset)) {
+        status = fill_pipe(s->node_fd, s->to_client, &s->to_client_len);
+        if (status == RELAY_OK) {
+            status = empty_pipe(s->client_fd, s->to_client, &s->to_client_len);
+        }
+        if (status == RELAY_FROM_CLOSED) {
+            /* Pass on what the node said before it went. */
+            empty_pipe(s->client_fd, s->to_client, &s->to_client_len);
+            recheck_session(s);
+            return;
+        }
+    }
+    if (status == RELAY_OK && FD_ISSET(s->client_fd, rset)) {
+        status = fill_pipe(s->client_fd, s->to_node, &s->to_node_len);
+    }
+    if (status == RELAY_OK && s->to_node_len > 0) {
+        status = empty_pipe(s->node_fd, s->to_node, &s->to_node_len);
+        if (status == RELAY_TO_CLOSED) {
+            recheck_session(s);
+            return;
+        }
+    }
+    if (status != RELAY_OK) {
+        remove_session(s);
+    }
+}
+
+void handle_sighup(int sig) {
+    reload_requested = 1;
+}
+
+
+int main(int argc, char **argv) {
+    int port = PORT;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:")) != -1) {
+        switch (opt) {
+        case 'p':
+            port = strtol(optarg, NULL, 10);
+            break;
+        default:
+            port = -1;
+        }
+    }
+    if (optind != argc - 1 || port <= 0) {
+        fprintf(stderr, "Usage: %s [-p port] <nodes filename>\n", argv[0]);
+        exit(1);
+    }
+    nodes_file = argv[optind];
+
+    signal(SIGPIPE, SIG_IGN);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_sighup;
+    sigaction(SIGHUP, &sa, NULL);
+
+    load_nodes();
+    check_health();
+
+    struct sockaddr_in *server = init_server_addr(port);
+    int listenfd = set_up_server_socket(server, MAX_QUEUE);
+    time_t last_check = time(NULL);
+    int serving = 0;  // Set once the first health checks are done
+
+    while (1) {
+        if (reload_requested) {
+            reload_requested = 0;
+            printf("Reloading %s\n", nodes_file);
+            reload_nodes();
+        }
+        if (time(NULL) - last_check >= HEALTH_INTERVAL) {
+            check_health();
+            last_check = time(NULL);
+        }
+        if (ring_changed) {
+            rebalance();
+        }
+
+        /* Read from a socket only while the pipe it fills is empty, and
+         * watch for room to write on the sockets whose pipe is not. Hold
+         * new clients back until the first health checks have found the
+         * nodes that are up.
+         */
+        fd_set rset, wset;
+        int maxfd = listenfd;
+        int waiting = 0;  // Something is due to time out
+        FD_ZERO(&rset);
+        FD_ZERO(&wset);
+        serving = serving || !checking();
+        if (serving) {
+            FD_SET(listenfd, &rset);
+        }
+        for (int i = 0; i < num_nodes; i++) {
+            if (nodes[i].check_fd != -1) {
+                FD_SET(nodes[i].check_fd, &rset);
+                maxfd = nodes[i].check_fd > maxfd ? nodes[i].check_fd : maxfd;
+                waiting = 1;
+            }
+        }
+        for (struct session *s = sessions; s; s = s->next) {
+            maxfd = s->client_fd > maxfd ? s->client_fd : maxfd;
+            if (s->to_client_len > 0) {
+                FD_SET(s->client_fd, &wset);
+            }
+            if (s->state == NAMING) {
+                FD_SET(s->client_fd, &rset);
+                continue;
+            }
+            if (s->state == RECHECKING) {
+                continue;
+            }
+            maxfd = s->node_fd > maxfd ? s->node_fd : maxfd;
+            if (s->state == CONNECTING) {
+                FD_SET(s->node_fd, &rset);
+                waiting = 1;
+                continue;
+            }
+            if (s->to_node_len == 0) {
+                FD_SET(s->client_fd, &rset);
+            }
+            if (s->to_client_len == 0) {
+                FD_SET(s->node_fd, &rset);
+            }
+            if (s->to_node_len > 0) {
+                FD_SET(s->node_fd, &wset);
+            }
+        }
+
+        /* Wake up often enough to time out checks and connections. */
+        struct timeval timeout = {HEALTH_INTERVAL, 0};
+        if (waiting) {
+            timeout.tv_sec = 0;
+            timeout.tv_usec = CONNECT_TIMEOUT * 1000 / 10;
+        }
+        if (select(maxfd + 1, &rset, &wset, NULL, &timeout) == -1) {
+            if (errno != EINTR) {
+                perror("select");
+            }
+            continue;
+        }
+
+        long now = now_ms();
+        for (int i = 0; i < num_nodes; i++) {
+            if (nodes[i].check_fd == -1) {
+                continue;
+            }
+            int status = 0;
+            if (FD_ISSET(nodes[i].check_fd, &rset)) {
+                status = read_welcome(nodes[i].check_fd, &nodes[i].check_got);
+            }
+            if (status == 1) {
+                finish_check(i, 1);
+            } else if (status == -1 || now > nodes[i].check_deadline) {
+                finish_check(i, 0);
+            }
+        }
+
+        /* New sessions go on the front of the list, after the ones select
+         * was asked about.
+         */
+        struct session *s = sessions;
+        if (FD_ISSET(listenfd, &rset)) {
+            add_session(listenfd);
+        }
+        while (s) {
+            /* s may be freed below, so remember where to go next. */
+            struct session *next = s->next;
+            if (s->state == NAMING) {
+                if (FD_ISSET(s->client_fd, &rset)) {
+                    read_name(s);
+                }
+            } else if (s->state == CONNECTING) {
+                connect_session(s, &rset);
+            } else if (s->state == RECHECKING) {
+                if (FD_ISSET(s->client_fd, &wset) &&
+                    empty_pipe(s->client_fd, s->to_client, &s->to_client_len) != RELAY_OK) {
+                    remove_session(s);
+                }
+            } else {
+                relay_session(s, &rset, &wset);
+            }
+            s = next;
+        }
+    }
+    return 0;
+}
@@ -10,36 +10,46 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <time.h>
+#include <signal.h>
+#include <fcntl.h>
 
 #include "socket.h"
 #include "gameplay.h"
+#include "bot.h"
+#include "trace.h"
 
 
 #ifndef PORT
 #define PORT y
 #endif
 #define MAX_QUEUE 5
+#define OUT_CHUNK 1024          // Output queues grow in multiples of this
+#define DEFAULT_CLIENT_KB 64
+#define DEFAULT_DRAIN_SECS 120
+#define DRAIN_FLUSH_SECS 5      // Time past the drain deadline to send output
+#define BUSY_MSG "The server is busy. Please try again later.\r\n"
+#define DRAIN_MSG "The server is shutting down: %d players finishing, " \
+                  "%ld seconds left. Please try again later.\r\n"
 
 
-void add_player(struct client **top, int fd, struct in_addr addr);
+int add_player(struct client **top, int fd, struct in_addr addr);
 void remove_player(struct client **top, int fd);
-
-/* These are some of the function prototypes that we used in our solution 
- * You are not required to write functions that match these prototypes, but
- * you may find the helpful when thinking about operations in your program.
- */
-/* Send the message in outbuf to all clients */
-int broadcast(struct game_state *game, char *outbuf);
-int announce_turn(struct game_state *game);
-int announce_winner(struct game_state *game, struct client *winner);
-/* Move the has_next_turn pointer to the next active client */
-void advance_turn(struct game_state *game);
-int Read(int fd, void *buf, size_t nbyte);
-int read_from_input(char *line, int fd);
-int restart_game(struct game_state *game, int fd, char *dict);
-int check_name(struct game_state *game, int fd, char *name);
-int check_good_guess(struct game_state *game, int guess);
-void disconnect_from_game(struct game_state *game, int fd);
+void free_client(struct client *p);
+
+int send_output(struct client *p, const char *msg, int len);
+int flush_output(struct client *p);
+int read_input(struct client *p);
+int next_line(struct client *p, char *line);
+void handle_line(struct game_state *game, struct client **new_players,
+                 struct client *p, char *line);
+void deliver_events(struct game_state *game, struct client **new_players,
+                    struct game_events *events);
+void disconnect_client(struct game_state *game, struct client **new_players,
+                       int fd);
+void shed_load(struct game_state *game, struct client **new_players);
+void close_client(struct client *p);
+void start_drain(struct game_state *game, struct client **new_players);
+int drain(struct game_state *game, struct client **new_players, int maxfd);
 
 
 /* The set of socket descriptors for select to monitor.
@@ -48,15 +58,78 @@ void disconnect_from_game(struct game_state *game, int fd);
  */
 fd_set allset;
 
+/* Every connected client, whether playing or still entering a name,
+ * indexed by socket descriptor.
+ */
+struct client *clients[FD_SETSIZE];
+
+/* Memory charged to clients: the client structs, which hold the input
+ * buffers, and their queued output. Past mem_soft new connections are
+ * turned away; past mem_hard clients are dropped until usage is back under
+ * mem_soft. No client may queue more than mem_client bytes of output.
+ * Unless they are given on the command line, the budgets are derived from
+ * the most the clients could ever hold (see default_budgets), so that they
+ * can actually be reached.
+ */
+size_t mem_used;
+size_t mem_soft;
+size_t mem_hard;
+size_t mem_client = DEFAULT_CLIENT_KB * 1024L;
+
+/* SIGTERM drains the server: it stops taking players and starting games, lets
+ * the game in progress finish its word, sends everyone their pending output
+ * and exits. The game gets drain_secs to finish; a second SIGTERM ends it
+ * right away.
+ */
+long drain_secs = DEFAULT_DRAIN_SECS;
+time_t drain_deadline;
+static volatile sig_atomic_t drain_requested;
+
+static void request_drain(int sig) {
+    drain_requested++;
+}
+
+#ifndef NO_TRACE
+/* Set by SIGUSR1 to have the main loop print the handler cycle counts. */
+static volatile sig_atomic_t dump_requested;
+
+static void request_dump(int sig) {
+    dump_requested = 1;
+}
+#endif
+
+
+/* Fill in the budgets not given on the command line. With every descriptor
+ * select can watch holding a full output queue, the clients would use
+ * FD_SETSIZE * (sizeof(struct client) + mem_client) bytes, give or take an
+ * OUT_CHUNK each; the hard budget is half of that and the soft budget two
+ * thirds of the hard one.
+ */
+static void default_budgets(void) {
+    size_t most = FD_SETSIZE * (sizeof(struct client) + mem_client + OUT_CHUNK);
+    if (mem_hard == 0) {
+        mem_hard = mem_soft > most / 2 ? mem_soft : most / 2;
+    }
+    if (mem_soft == 0) {
+        mem_soft = mem_hard / 3 * 2;
+    }
+}
+
+/* Charge bytes (which may be negative) to p and to the server's total. */
+static void charge(struct client *p, long bytes) {
+    p->mem += bytes;
+    mem_used += bytes;
+}
 
-/* Add a client to the head of the linked list
+/* Add a client to the head of the linked list. Return -1 if there is no
+ * memory for it.
  */
-void add_player(struct client **top, int fd, struct in_addr addr) {
+int add_player(struct client **top, int fd, struct in_addr addr) {
     struct client *p = malloc(sizeof(struct client));
 
     if (!p) {
         perror("malloc");
-        exit(1);
+        return -1;
     }
 
     printf("Adding client %s\n", inet_ntoa(addr));
@@ -66,8 +139,27 @@ void add_player(struct client **top, int fd, struct in_addr addr) {
     p->name[0] = '\0';
     p->in_ptr = p->inbuf;
     p->inbuf[0] = '\0';
+    p->outbuf = NULL;
+    p->out_len = 0;
+    p->out_cap = 0;
+    p->mem = 0;
+    p->closing = 0;
+    charge(p, sizeof(struct client));
+    clients[fd] = p;
     p->next = *top;
     *top = p;
+    return 0;
+}
+
+/* Close the client's socket, remove it from allset and release its memory.
+ */
+void free_client(struct client *p) {
+    FD_CLR(p->fd, &allset);
+    close(p->fd);
+    clients[p->fd] = NULL;
+    mem_used -= p->mem;
+    free(p->outbuf);
+    free(p);
 }
 
 /* Removes client from the linked list and closes its socket.
@@ -82,9 +174,7 @@ void remove_player(struct client **top, int fd) {
     if (*p) {
         struct client *t = (*p)->next;
         printf("Removing client %d %s\n", fd, inet_ntoa((*p)->ipaddr));
-        FD_CLR((*p)->fd, &allset);
-        close((*p)->fd);
-        free(*p);
+        free_client(*p);
         *p = t;
     } else {
         fprintf(stderr, "Trying to remove fd %d, but I don't know about it\n",
@@ -92,258 +182,402 @@ void remove_player(struct client **top, int fd) {
     }
 }
 
-/* Send the message in outbuf to all clients 
- * Return -1 if detected disconnection. 
+
+/* Send len bytes of msg to p. Whatever the socket won't take right away is
+ * queued behind the output already waiting and sent once select reports
+ * the socket writable. Return -1 if the socket failed or p would have more
+ * than mem_client bytes queued.
  */
-int broadcast(struct game_state *game, char *outbuf) {
-    struct client *cur_client = game->head; // the client pointer for traversal
+int send_output(struct client *p, const char *msg, int len) {
+    int sent = 0;
+    if (p->out_len == 0) {
+        sent = write(p->fd, msg, len);
+        if (sent == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return -1;
+            }
+            sent = 0;
+        }
+        if (sent == len) {
+            return 0;
+        }
+    }
 
-    while (cur_client) {
-        /* Send message to all clients. */
-        if (write(cur_client->fd, outbuf, strlen(outbuf)) == -1) {
+    int need = p->out_len + len - sent;
+    if (need > mem_client) {
+        fprintf(stderr, "[%d] Too slow: %d bytes of output waiting\n", p->fd, need);
+        return -1;
+    }
+    if (need > p->out_cap) {
+        int cap = (need + OUT_CHUNK - 1) / OUT_CHUNK * OUT_CHUNK;
+        char *buf = realloc(p->outbuf, cap);
+        if (buf == NULL) {
+            perror("realloc");
             return -1;
         }
-        cur_client = cur_client->next;
+        charge(p, cap - p->out_cap);
+        p->outbuf = buf;
+        p->out_cap = cap;
     }
+    memcpy(p->outbuf + p->out_len, msg + sent, len - sent);
+    p->out_len += len - sent;
     return 0;
 }
 
-/* Announce the next turn of game. 
- * Return -1 if detected disconnection. 
+/* Write as much of p's queued output as its socket will take, and release
+ * the queue once it is empty. Return -1 if the socket failed.
  */
-int announce_turn(struct game_state *game) {
-    struct client *cur_client = game->head; // the client pointer for traversal
-    char msg[MAX_MSG];                      // the messege container
-
-    /* Display turn message in server. */
-    sprintf(msg, "It's %s's turn.\n", game->has_next_turn->name);
-    printf("%s", msg);
-
-    while (cur_client) {
-        /* Send guess message to the next player. */
-        if (cur_client->fd == game->has_next_turn->fd) {
-            if (write(cur_client->fd, GUESS_MSG, strlen(GUESS_MSG)) == -1) {
-                return -1;
-            }
-        }
-        /* Send turn message to other clients. */
-        else {
-            if (write(cur_client->fd, msg, strlen(msg)) == -1) {
-                return -1;
-            }
-        }
-        cur_client = cur_client->next;
+int flush_output(struct client *p) {
+    int sent = write(p->fd, p->outbuf, p->out_len);
+    if (sent == -1) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+    p->out_len -= sent;
+    memmove(p->outbuf, p->outbuf + sent, p->out_len);
+    if (p->out_len == 0) {
+        charge(p, -p->out_cap);
+        free(p->outbuf);
+        p->outbuf = NULL;
+        p->out_cap = 0;
     }
     return 0;
 }
 
-/* Announce winner aa the the winner of game. 
- * Return -1 if detected disconnection. 
+/* Read what is waiting on p's socket into the free part of its input buffer.
+ * Return -1 if the client has disconnected and 0 otherwise.
  */
-int announce_winner(struct game_state *game, struct client *winner) {
-    struct client *cur_client = game->head; // the client pointer for traversal
-    char msg[MAX_MSG];                      // the messege container
-
-    /* Send word message to all clients. */
-    sprintf(msg, "The word was %s. \n", game->word);
-    if (broadcast(game, msg) == -1) {
-        return -1;
+int read_input(struct client *p) {
+    int room = MAX_BUF - 1 - (p->in_ptr - p->inbuf);
+    int num_chars = read(p->fd, p->in_ptr, room);
+    if (num_chars == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return 0;
     }
-    /* Display winner message in server. */
-    sprintf(msg, "Game over! %s won!\n\n", winner->name);
-    printf("%s", msg);
-
-    while (cur_client) {
-        /* Send winner message to the winner. */
-        if (cur_client->fd == winner->fd) {
-            if (write(cur_client->fd, WIN_MSG, strlen(WIN_MSG)) == -1) {
-                return -1;
-            }
-        }
-        /* Send winner message to other clients. */
-        else {
-            if (write(cur_client->fd, msg, strlen(msg)) == -1) {
-                return -1;
-            }
-        }
-        cur_client = cur_client->next;
+    if (num_chars <= 0) {
+        return -1;
     }
+    printf("[%d] Read %d bytes\n", p->fd, num_chars);
+    p->in_ptr += num_chars;
+    *p->in_ptr = '\0';
     return 0;
 }
 
-/* Move the has_next_turn pointer to the next active client */
-void advance_turn(struct game_state *game) {
-    /* Set has_next_turn NULL if the last client leaves. */
-    if (game->head == NULL) {
-        game->has_next_turn = NULL;
-    }
-    /* Next turn points to the head in two cases below: 
-     * has_next_turn has not been set or
-     * has_next_turn is the last player of the active list.
-     */
-    else if (game->has_next_turn == NULL || game->has_next_turn->next == NULL) {
-        game->has_next_turn = game->head;
+/* If p's input buffer holds a whole line, move it into line, dealing with
+ * network newline, and return 1. A line too long for the buffer is taken as
+ * soon as the buffer fills up. Otherwise return 0 and wait for more input.
+ */
+int next_line(struct client *p, char *line) {
+    int buffered = p->in_ptr - p->inbuf;
+    int len;   // the length of the line
+    int used;  // the length of the line and its newline
+
+    char *end = strstr(p->inbuf, "\r\n");
+    if (end != NULL) {
+        len = end - p->inbuf;
+        used = len + 2;
+    } else if (buffered == MAX_BUF - 1) {
+        len = used = buffered;
+    } else {
+        return 0;
     }
-    /* Turn to next. */
-    else {
-        game->has_next_turn = game->has_next_turn->next;
+
+    memcpy(line, p->inbuf, len);
+    line[len] = '\0';
+    memmove(p->inbuf, p->inbuf + used, buffered - used + 1);
+    p->in_ptr -= used;
+
+    /* Display nonempty input. */
+    if (len > 0) {
+        printf("[%d] Found newline %s\n", p->fd, line);
     }
+    TRACE_PROBE2(line_received, p->fd, len);
+    return 1;
 }
 
-/* wrapper function for read */
-int Read(int fd, void *buf, size_t nbyte) {
-    int bytes = read(fd, buf, nbyte);
+/* Act on a line of input from p, who is either playing or entering a name.
+ */
+void handle_line(struct game_state *game, struct client **new_players,
+                 struct client *p, char *line) {
+    struct game_events events; // what the game wants to say
+    events.count = 0;
+
+    if (find_player(game, p->fd) != -1) {
+        game_guess(game, p, line, &events);
+        deliver_events(game, new_players, &events);
+
+        /* Let the bot take its turns right away. */
+        events.count = 0;
+        while (bot_turn(game, &events)) {
+            deliver_events(game, new_players, &events);
+            events.count = 0;
+        }
+        return;
+    }
 
-    if (bytes == -1) {
-        perror("read");
-        exit(1);
+    /* If name input by the client is valid, deal with it. 
+     * Otherwise, wait for the next line. 
+     */
+    strncpy(p->name, line, MAX_NAME);
+    p->name[MAX_NAME - 1] = '\0';
+    if (check_name(game, p->fd, p->name, &events)) {
+        struct client **link; // the link that points at p
+
+        /* Remove p from new_players and add it to the game. */
+        for (link = new_players; *link != p; link = &(*link)->next);
+        *link = p->next;
+        game_join(game, p, &events);
     }
-    return bytes;
+    deliver_events(game, new_players, &events);
 }
 
-/* Read the input into line, dealing with network newline. 
- * Return the total number of characters read. 
+/* Send each event to the clients it is addressed to. Every client whose
+ * socket fails is disconnected afterwards, which may generate (and deliver)
+ * further events for the players that remain.
  */
-int read_from_input(char *line, int fd) {
-    line[0] = '\0'; // Initialize line to an empty string.
-
-    /* First read from input. */
-    int num_chars1 = Read(fd, line, MAX_BUF);
-    line[num_chars1] = '\0';
-    printf("[%d] Read %d bytes\n", fd, num_chars1);
-
-    /* It may take more than one read to get all of the data that was written. */
-    while (num_chars1 > 0 && strstr(line, "\r\n") == NULL) {
-        int num_chars2 = Read(fd, &line[num_chars1], MAX_BUF - num_chars1);
-        printf("[%d] Read %d bytes\n", fd, num_chars2);
-        num_chars1 += num_chars2;
-        line[num_chars1] = '\0';
+void deliver_events(struct game_state *game, struct client **new_players,
+                    struct game_events *events) {
+    fd_set failed;         // clients whose socket failed during this delivery
+    int max_failed = -1;
+    int fds[MAX_PLAYERS];  // the recipients of one event
+    int sends = 0;
+
+    CYCLES_BEGIN(H_DELIVER);
+    FD_ZERO(&failed);
+    for (int i = 0; i < events->count; i++) {
+        struct game_event *ev = &events->list[i];
+        int len = strlen(ev->msg);
+
+        /* Display broadcast messages in server. A TO_PLAYER event may
+         * address a client that is not playing yet.
+         */
+        if (ev->to != TO_PLAYER) {
+            printf("%s", ev->msg);
+        }
+        int count = game_recipients(game, ev, fds);
+        for (int j = 0; j < count; j++) {
+            if (clients[fds[j]] == NULL || FD_ISSET(fds[j], &failed)) {
+                continue;
+            }
+            if (send_output(clients[fds[j]], ev->msg, len) == -1) {
+                FD_SET(fds[j], &failed);
+                max_failed = fds[j] > max_failed ? fds[j] : max_failed;
+            }
+            sends++;
+        }
     }
+    CYCLES_END(H_DELIVER);
+    TRACE_PROBE2(broadcast_complete, events->count, sends);
 
-    /* Strip trailing network newline and display nonempty input. */
-    line[num_chars1 - 2] = '\0';
-    if (strlen(line) > 0) {
-        printf("[%d] Found newline %s\n", fd, line);
+    for (int fd = 0; fd <= max_failed; fd++) {
+        if (FD_ISSET(fd, &failed)) {
+            disconnect_client(game, new_players, fd);
+        }
     }
-    return num_chars1;
 }
 
-/* Restart a game with a new word. */
-int restart_game(struct game_state *game, int fd, char *dict) {
-    /* Send new game message to all. */
-    printf("New game\n");
-    if (broadcast(game, "Let's start a new game\n") == -1) {
-        return -1;
+/* Disconnect the client with fd, whether it is an active player or is still
+ * entering its name, and tell the remaining players about it.
+ */
+void disconnect_client(struct game_state *game, struct client **new_players,
+                       int fd) {
+    struct game_events events;
+    events.count = 0;
+
+    struct client *p = game_leave(game, fd, &events);
+    if (p != NULL) {
+        printf("Disconnect from %s\n", inet_ntoa(p->ipaddr));
+        free_client(p);
+        deliver_events(game, new_players, &events);
+        return;
     }
-    init_game(game, dict); // Initialize a new game. 
-    return 0;
-}
 
-/* Check if the input name is valid. */
-int check_name(struct game_state *game, int fd, char *name) {
-    struct client *cur_client = game->head; // the client pointer for traversal
+    for (p = *new_players; p && p->fd != fd; p = p->next);
+    if (p != NULL) {
+        printf("Disconnect from %s\n", inet_ntoa(p->ipaddr));
+        remove_player(new_players, fd);
+    }
+}
 
-    /* Check empty name: */
-    if (strlen(name) == 0) {
-        /* Send empty name message to the current client. */
-        if (write(fd, EMPTY_NAME_MSG, strlen(EMPTY_NAME_MSG)) == -1) {
-            return -1;
-        }
-        return 0;
+/* Once memory use passes mem_hard, drop clients until it is back under
+ * mem_soft: first the client still entering a name that holds the most
+ * memory, then the player with the most output waiting.
+ */
+void shed_load(struct game_state *game, struct client **new_players) {
+    if (mem_used <= mem_hard) {
+        return;
     }
-    /* Check duplicate name: */
-    while (cur_client) {
-        if (strcmp(cur_client->name, name) == 0) {
-            /* Send duplicate name message to the current client. */
-            if (write(fd, DUPLICATE_NAME_MSG, strlen(DUPLICATE_NAME_MSG)) == -1) {
-                return -1;
+    while (mem_used > mem_soft) {
+        struct client *victim = NULL;
+        for (struct client *p = *new_players; p != NULL; p = p->next) {
+            if (victim == NULL || p->mem > victim->mem) {
+                victim = p;
             }
-            return 0;
         }
-        cur_client = cur_client->next;
-    }
-    return 1;
-}
-
-/* Check if the guess letter has not already been guessed and is in the word. */
-int check_good_guess(struct game_state *game, int guess) {
-    int good_guess = 0; // the indicator of good guess
-
-    /* Check if guess is in letter_guessed. */
-    if (game->letters_guessed[guess - 'a'] == 0) {
-        game->letters_guessed[guess - 'a'] = 1; // Change the indicator of this guess letter in letter_guessed. 
-        /* Check if this letter is in the word. */
-        for (int i = 0; i < strlen(game->word); i++) {
-            if (game->word[i] == guess) {
-                game->guess[i] = guess;
-                good_guess = 1;
+        if (victim == NULL) {
+            for (int i = 0; i < game->num_players; i++) {
+                struct client *p = game->players[i];
+                if (p->fd >= 0 && p->out_len > 0 &&
+                    (victim == NULL || p->mem > victim->mem)) {
+                    victim = p;
+                }
             }
         }
+        if (victim == NULL) {
+            return;
+        }
+        printf("Memory use %lu over budget: dropping client %d holding %lu bytes\n",
+               (unsigned long) mem_used, victim->fd, (unsigned long) victim->mem);
+        disconnect_client(game, new_players, victim->fd);
     }
-    return good_guess;
 }
 
-/* Disconnect client with fd from game until there is no more disconnection detected by write function. */
-void disconnect_from_game(struct game_state *game, int fd) {
-    struct client *p;  // the client pointer for traversal
-    char msg[MAX_MSG]; // the messege container
-
-    for (p = game->head; p && p->fd != fd; p = p->next);  // Find the client p with fd.
-    printf("Disconnect from %s\n", inet_ntoa(p->ipaddr)); // Display disconnect message in server.
-    
-    /*  Save important data temporarily. */
-    sprintf(msg, "Goodbye %s\n", p->name);
-    int next_fd = game->has_next_turn->fd;
-
-    /* This is for preventing has_next_turn become unaccessable after remove_player. */
-    if (next_fd == fd) {
-        game->has_next_turn = NULL;
+/* Stop reading from p and disconnect it once its queued output is sent.
+ */
+void close_client(struct client *p) {
+    p->closing = 1;
+    FD_CLR(p->fd, &allset);
+}
+
+/* Begin draining: say goodbye to the clients still entering a name and let
+ * the game finish its current word. A game nobody is playing stops at once.
+ */
+void start_drain(struct game_state *game, struct client **new_players) {
+    struct game_events events;
+    events.count = 0;
+
+    game->draining = 1;
+    drain_deadline = time(NULL) + drain_secs;
+    printf("Draining: %d players have %ld seconds to finish\n",
+           game->num_players, drain_secs);
+
+    for (struct client *p = *new_players; p != NULL; p = p->next) {
+        send_output(p, SHUTDOWN_MSG, strlen(SHUTDOWN_MSG));
+        close_client(p);
     }
+    if (game->num_players == 0) {
+        game_stop(game, &events);
+    }
+}
+
+/* Make progress on the drain: stop the game if the deadline has passed,
+ * close every client once the game is over, and disconnect the clients whose
+ * output has all been sent. Return 1 when no client is left or time is up.
+ */
+int drain(struct game_state *game, struct client **new_players, int maxfd) {
+    static int last_remaining = -1;
+    time_t now = time(NULL);
 
-    remove_player(&(game->head), fd); // Remove player with fd from game.
-    /* Advance turn if the disconnet client is the next player. */
-    if (next_fd == fd) {
-        advance_turn(game);
+    if (drain_requested > 1 && drain_deadline > now) {
+        drain_deadline = now;
     }
-    /* Announce turn and send goodbye message to all clients unless there is no active client. */
-    if (game->head != NULL) {
-        if (broadcast(game, msg) == -1) {
-            disconnect_from_game(game, fd); // Recursion for more disconnection in broadcast.
+    if (now >= drain_deadline && !game->over) {
+        struct game_events events;
+        events.count = 0;
+        game_stop(game, &events);
+        deliver_events(game, new_players, &events);
+    }
+
+    int remaining = 0;
+    for (int fd = 0; fd <= maxfd; fd++) {
+        struct client *p = clients[fd];
+        if (p == NULL) {
+            continue;
+        }
+        if (game->over && !p->closing) {
+            close_client(p);
         }
-        if (announce_turn(game) == -1) {
-            disconnect_from_game(game, fd); // Recursion for more disconnection in broadcast.
+        if (p->closing && p->out_len == 0) {
+            disconnect_client(game, new_players, fd);
+        } else {
+            remaining++;
         }
     }
-    return;
-}
 
+    if (remaining != last_remaining) {
+        printf("Draining: %d clients left, game %s, %ld seconds to the deadline\n",
+               remaining, game->over ? "over" : "in progress",
+               (long) (drain_deadline - now));
+        last_remaining = remaining;
+    }
+    return remaining == 0 || now >= drain_deadline + DRAIN_FLUSH_SECS;
+}
 
 int main(int argc, char **argv) {
     int clientfd, maxfd, nready;
     struct client *p;
     struct sockaddr_in q;
-    fd_set rset;
-
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <dictionary filename>\n", argv[0]);
+    fd_set rset, wset;
+
+    int port = PORT;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:m:M:c:d:")) != -1) {
+        switch (opt) {
+        case 'p':
+            port = strtol(optarg, NULL, 10);
+            break;
+        case 'm':
+            mem_soft = strtol(optarg, NULL, 10) * 1024L;
+            break;
+        case 'M':
+            mem_hard = strtol(optarg, NULL, 10) * 1024L;
+            break;
+        case 'c':
+            mem_client = strtol(optarg, NULL, 10) * 1024L;
+            break;
+        case 'd':
+            drain_secs = strtol(optarg, NULL, 10);
+            break;
+        default:
+            port = -1;
+        }
+    }
+    default_budgets();
+    if (optind != argc - 1 || port <= 0 || mem_soft > mem_hard || mem_client == 0 ||
+        drain_secs < 0) {
+        fprintf(stderr, "Usage: %s [-p port] [-m soft KB] [-M hard KB] "
+                "[-c client output KB] [-d drain seconds] <dictionary filename>\n",
+                argv[0]);
         exit(1);
     }
+    char *dict_name = argv[optind];
+    printf("Memory budgets: soft %lu KB, hard %lu KB, %lu KB of output per client\n",
+           (unsigned long) mem_soft / 1024, (unsigned long) mem_hard / 1024,
+           (unsigned long) mem_client / 1024);
+
+    /* A client that hangs up should make write fail, not kill the server. */
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGTERM, request_drain);
+#ifndef NO_TRACE
+    signal(SIGUSR1, request_dump);
+#endif
+    /* Keep SIGTERM and SIGUSR1 blocked except while waiting in pselect, so
+     * that one arriving after the loop checks for it still wakes the wait.
+     */
+    sigset_t blocked, waitmask;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGTERM);
+    sigaddset(&blocked, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &blocked, &waitmask);
 
     // Create and initialize the game state
     struct game_state game;
 
     srandom((unsigned int) time(NULL));
-    // Set up the file pointer outside of init_game because we want to 
-    // just rewind the file when we need to pick a new word
-    game.dict.fp = NULL;
-    game.dict.size = get_file_length(argv[1]);
+    // Open the dictionary outside of init_game because every game picks
+    // its word from the same dictionary
+    dict_open(&game.dict, dict_name);
+    game.round = 0;
+    game.draining = 0;
+    game.over = 0;
 
-    init_game(&game, argv[1]);
+    init_game(&game);
 
-    // head and has_next_turn also don't change when a subsequent game is
+    // The players and turn also don't change when a subsequent game is
     // started so we initialize them here.
-    game.head = NULL;
-    game.has_next_turn = NULL;
+    game.num_players = 0;
+    game.turn = -1;
+    game.bots = 1;
+    game.words = NULL;
+    game.candidates = NULL;
 
     /* A list of client who have not yet entered their name.  This list is
      * kept separate from the list of active players in the game, because
@@ -353,7 +587,7 @@ int main(int argc, char **argv) {
      */
     struct client *new_players = NULL;
 
-    struct sockaddr_in *server = init_server_addr(PORT);
+    struct sockaddr_in *server = init_server_addr(port);
     int listenfd = set_up_server_socket(server, MAX_QUEUE);
 
     // initialize allset and add listenfd to the
@@ -364,218 +598,147 @@ int main(int argc, char **argv) {
     maxfd = listenfd;
 
     while (1) {
-        // make a copy of the set before we pass it into select
+        trace_end_iteration();
+#ifndef NO_TRACE
+        if (dump_requested) {
+            dump_requested = 0;
+            trace_dump();
+        }
+#endif
+        if (drain_requested && !game.draining) {
+            start_drain(&game, &new_players);
+        }
+        if (game.draining && drain(&game, &new_players, maxfd)) {
+            break;
+        }
+
+        // make a copy of the set before we pass it into select, and watch
+        // for room to write on the sockets that have output waiting
         rset = allset;
-        nready = select(maxfd + 1, &rset, NULL, NULL, NULL);
+        FD_ZERO(&wset);
+        for (int fd = 0; fd <= maxfd; fd++) {
+            if (clients[fd] != NULL && clients[fd]->out_len > 0) {
+                FD_SET(fd, &wset);
+            }
+        }
+        // while draining, wake up at least once a second to check the deadline
+        struct timespec tick = {1, 0};
+        CYCLES_BEGIN(H_SELECT);
+        nready = pselect(maxfd + 1, &rset, &wset, NULL, game.draining ? &tick : NULL,
+                         &waitmask);
+        CYCLES_END(H_SELECT);
         if (nready == -1) {
-            perror("select");
+            if (errno != EINTR) {
+                perror("pselect");
+            }
             continue;
         }
 
         if (FD_ISSET(listenfd, &rset)) {
+            CYCLES_BEGIN(H_ACCEPT);
             printf("A new client is connecting\n");
             clientfd = accept_connection(listenfd);
-
-            FD_SET(clientfd, &allset);
-            if (clientfd > maxfd) {
-                maxfd = clientfd;
+            TRACE_PROBE1(accept, clientfd);
+
+            /* While draining, keep answering connections with the drain's
+             * progress instead of the welcome, so that load balancers and
+             * wordrouter's health checks send new players elsewhere.
+             */
+            if (clientfd == -1) {
+                // accept failed; the error has been reported
+            } else if (game.draining) {
+                char msg[MAX_MSG];
+                snprintf(msg, MAX_MSG, DRAIN_MSG, game.num_players,
+                         (long) (drain_deadline - time(NULL)));
+                write(clientfd, msg, strlen(msg));
+                close(clientfd);
+            } else if (mem_used > mem_soft) {
+                /* Turn new clients away while memory use is over budget. */
+                printf("Memory use %lu over budget: refusing connection\n",
+                       (unsigned long) mem_used);
+                write(clientfd, BUSY_MSG, strlen(BUSY_MSG));
+                close(clientfd);
+            } else if (clientfd >= FD_SETSIZE) {
+                /* select and clients can only hold descriptors below
+                 * FD_SETSIZE.
+                 */
+                printf("Descriptor %d out of range: refusing connection\n", clientfd);
+                write(clientfd, BUSY_MSG, strlen(BUSY_MSG));
+                close(clientfd);
+            } else if (add_player(&new_players, clientfd, q.sin_addr) == -1) {
+                close(clientfd);
+            } else {
+                fcntl(clientfd, F_SETFL, fcntl(clientfd, F_GETFL) | O_NONBLOCK);
+                FD_SET(clientfd, &allset);
+                if (clientfd > maxfd) {
+                    maxfd = clientfd;
+                }
+                printf("Connection from %s\n", inet_ntoa(q.sin_addr));
+                char *greeting = WELCOME_MSG;
+                if (send_output(clients[clientfd], greeting, strlen(greeting)) == -1) {
+                    fprintf(stderr, "Write to client %s failed\n", inet_ntoa(q.sin_addr));
+                    remove_player(&new_players, clientfd);
+                }
             }
-            printf("Connection from %s\n", inet_ntoa(q.sin_addr));
-            add_player(&new_players, clientfd, q.sin_addr);
-            char *greeting = WELCOME_MSG;
-            if (write(clientfd, greeting, strlen(greeting)) == -1) {
-                fprintf(stderr, "Write to client %s failed\n", inet_ntoa(q.sin_addr));
-                remove_player(&new_players, clientfd);
-            };
+            CYCLES_END(H_ACCEPT);
         }
 
-        /* Check which other socket descriptors have something ready to read.
-         * The reason we iterate over the rset descriptors at the top level and
-         * search through the two lists of clients each time is that it is
-         * possible that a client will be removed in the middle of one of the
-         * operations. This is also why we call break after handling the input.
-         * If a client has been removed the loop variables may not longer be 
-         * valid.
+        /* Check which other socket descriptors are ready. The reason we
+         * iterate over the descriptors at the top level and look each client
+         * up again is that it is possible that a client will be removed in
+         * the middle of one of the operations. If a client has been removed
+         * the loop variables may not longer be valid.
          */
         int cur_fd;
         for (cur_fd = 0; cur_fd <= maxfd; cur_fd++) {
+            if ((p = clients[cur_fd]) == NULL) {
+                continue;
+            }
+            if (FD_ISSET(cur_fd, &wset)) {
+                CYCLES_BEGIN(H_FLUSH);
+                int failed = flush_output(p);
+                CYCLES_END(H_FLUSH);
+                if (failed == -1) {
+                    disconnect_client(&game, &new_players, cur_fd);
+                    continue;
+                }
+            }
             if (FD_ISSET(cur_fd, &rset)) {
-                // Check if this socket descriptor is an active player
-
-                for (p = game.head; p != NULL; p = p->next) {
-                    if (cur_fd == p->fd) {
-                        char msg[MAX_MSG];  // the messege container
-
-                        /* Check whether the client disconnect when input a name, */
-                        if (read_from_input(p->inbuf, cur_fd) == 0) {
-                            disconnect_from_game(&game, cur_fd);
-                            break;
-                        }
-
-                        /* For the next player, */
-                        if (game.has_next_turn->fd == p->fd) {
-                            int guess = p->inbuf[0]; // the guessed letter
-
-                            /* Check the validity of guess. */
-                            if (strlen(p->inbuf) != 1 || guess < 'a' || guess > 'z') {
-                                if (write(cur_fd, INVALID_GUESS_MSG, strlen(INVALID_GUESS_MSG)) == -1) {
-                                    disconnect_from_game(&game, cur_fd);
-                                    break;
-                                }
-                            } else {
-                                /* Display guesses message to all clients. */
-                                sprintf(msg, "%s guesses: %c\n", game.has_next_turn->name, guess);
-                                if (broadcast(&game, msg) == -1) {
-                                    disconnect_from_game(&game, cur_fd);
-                                    break;
-                                }
-
-                                int good_guess = check_good_guess(&game, guess); // the indicator of good guess
-
-                                /* If it is not a good guess, */
-                                if (!good_guess) {
-                                    /* Display bad guess message to all. */
-                                    sprintf(msg, "%c is not in the word\n", guess);
-                                    if (write(cur_fd, msg, strlen(msg)) == -1) {
-                                        disconnect_from_game(&game, cur_fd);
-                                        break;
-                                    }
-                                    printf("Letter %s", msg);
-                                    /* Do guesses_left deccrement and turn to next player. */
-                                    game.guesses_left--;
-                                    advance_turn(&game);
-                                    /* If there is no guesses remaining, */
-                                    if (game.guesses_left == 0) {
-                                        /* Display lose message to all. */
-                                        printf("Evaluating for game_over\n");
-                                        sprintf(msg, "No guesses left. Game over.\nThe word was %s. \n\n", game.word);
-                                        if (broadcast(&game, msg) == -1) {
-                                            disconnect_from_game(&game, cur_fd);
-                                            break;
-                                        }
-                                        /* Restart a game. */
-                                        if (restart_game(&game, cur_fd, argv[1]) == -1) {
-                                            disconnect_from_game(&game, cur_fd);
-                                            break;
-                                        }
-                                    }
-                                }
-                                    /* If the word has been reached, */
-                                else if (strcmp(game.guess, game.word) == 0) {
-                                    /* Announce the winner. */
-                                    if (announce_winner(&game, game.has_next_turn) == -1) {
-                                        disconnect_from_game(&game, cur_fd);
-                                        break;
-                                    }
-                                    /* Restart a game. */
-                                    if (restart_game(&game, cur_fd, argv[1]) == -1) {
-                                        disconnect_from_game(&game, cur_fd);
-                                        break;
-                                    }
-                                }
-
-                                /* Display status and turn message to all clients. */
-                                status_message(msg, &game);
-                                if (broadcast(&game, msg) == -1) {
-                                    disconnect_from_game(&game, cur_fd);
-                                    break;
-                                }
-                                if (announce_turn(&game) == -1) {
-                                    disconnect_from_game(&game, cur_fd);
-                                    break;
-                                }
-                            }
-                        }
-                            /* For other players, */
-                        else {
-                            if (strlen(p->inbuf) > 0) {
-                                /* Display not turn message to mistyping players. */
-                                if (write(cur_fd, NOT_TURN_MSG, strlen(NOT_TURN_MSG)) == -1) {
-                                    disconnect_from_game(&game, cur_fd);
-                                    break;
-                                }
-                            }
-                        }
-
-                        break;
-                    }
+                char line[MAX_BUF]; // one line of input from the client
+
+                /* Check whether the client disconnected. */
+                CYCLES_BEGIN(H_READ);
+                int failed = read_input(p);
+                CYCLES_END(H_READ);
+                if (failed == -1) {
+                    disconnect_client(&game, &new_players, cur_fd);
+                    continue;
                 }
-
-                // Check if any new players are entering their names
-                for (p = new_players; p != NULL; p = p->next) {
-                    if (cur_fd == p->fd) {
-                        char msg[MAX_MSG]; // the messege container
-                        int valid_name;    // the indicator of valid name
-
-                        /* Check whether the client disconnect when input a name, */
-                        if (read_from_input(p->name, cur_fd) == 0) {
-                            printf("Disconnect from %s\n", inet_ntoa(q.sin_addr));
-                            remove_player(&new_players, cur_fd);
-                            break;
-                        }
-
-                        /* Check whether it is a valid name or disconnect here. */
-                        if ((valid_name = check_name(&game, cur_fd, p->name)) == -1) {
-                            printf("Disconnect from %s\n", inet_ntoa(q.sin_addr));
-                            remove_player(&new_players, cur_fd);
-                            break;
-                        }
-
-                        /* If name input by the client is valid, deal with it. 
-                         * Otherwise, wait for the next iteration. 
-                         */
-                        if (valid_name) {
-                            struct client *pre_client = new_players; // the client pointer for traversal
-
-                            /* Remove p from new_players. */
-                            if (pre_client->fd == cur_fd) {
-                                new_players = pre_client->next;
-                            } else {
-                                while (pre_client && pre_client->next->fd != cur_fd) {
-                                    pre_client = pre_client->next;
-                                }
-                                pre_client->next = p->next;
-                            }
-
-                            /* Add p to active linked list. */
-                            p->next = game.head;
-                            game.head = p;
-
-                            /* Display join message to all. */
-                            sprintf(msg, "%s has just joined.\n", game.head->name);
-                            printf("%s", msg);
-                            if (broadcast(&game, msg) == -1) {
-                                printf("Disconnect from %s\n", inet_ntoa(q.sin_addr));
-                                remove_player(&new_players, cur_fd);
-                                break;
-                            }
-
-                            /* Display status message to the new active player. */
-                            status_message(msg, &game);
-                            if (write(cur_fd, msg, strlen(msg)) == -1) {
-                                printf("Disconnect from %s\n", inet_ntoa(q.sin_addr));
-                                remove_player(&new_players, cur_fd);
-                                break;
-                            }
-
-                            /* For fist active player, set him as the next turn. */
-                            if (game.has_next_turn == NULL) {
-                                advance_turn(&game);
-                            }
-                            /* Announce turn whenever a player join the game. */
-                            if (announce_turn(&game) == -1) {
-                                printf("Disconnect from %s\n", inet_ntoa(q.sin_addr));
-                                remove_player(&new_players, cur_fd);
-                                break;
-                            }
-                        }
-
-                        break;
-                    }
+                /* Handle every complete line, unless handling one of them
+                 * removed the client.
+                 */
+                while (clients[cur_fd] == p && next_line(p, line)) {
+                    CYCLES_BEGIN(H_LINE);
+                    handle_line(&game, &new_players, p, line);
+                    CYCLES_END(H_LINE);
                 }
             }
         }
+
+        CYCLES_BEGIN(H_SHED);
+        shed_load(&game, &new_players);
+        CYCLES_END(H_SHED);
+    }
+
+    /* Out of time: give whatever output is still queued one last try. */
+    for (int fd = 0; fd <= maxfd; fd++) {
+        if (clients[fd] != NULL && clients[fd]->out_len > 0) {
+            flush_output(clients[fd]);
+        }
     }
+    close(listenfd);
+    dict_close(&game.dict);
+    printf("Drained, exiting\n");
     return 0;
 }
 